@@ -0,0 +1,283 @@
+/*
+ * BSD Zero Clause License
+ *
+ * Copyright © 2023–2024 Thomas Voss
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS” AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A minimal reference server for the remote compilation cache used by
+ * cacheremote().  It serves GET and HEAD requests from and stores PUT
+ * requests into a directory, forking once per connection.
+ *
+ * Usage: cachesrv [-p port] dir
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define MAXHDR  8192
+#define MAXBODY (1024 * 1024 * 1024)
+
+static void serve(int);
+static bool sendall(int, const void *, size_t);
+static void reply(int, int, const char *, const char *, size_t);
+static bool pathok(const char *);
+static bool mkdirs(char *);
+
+static const char *argv0;
+
+int
+main(int argc, char **argv)
+{
+	int opt, sfd, on = 1;
+	unsigned short port = 8080;
+	struct sockaddr_in6 sa = {0};
+
+	argv0 = argv[0];
+	while ((opt = getopt(argc, argv, "p:")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+usage:
+			fprintf(stderr, "Usage: %s [-p port] dir\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (argc - optind != 1)
+		goto usage;
+
+	if (chdir(argv[optind]) == -1) {
+		fprintf(stderr, "%s: chdir: %s: %s\n", argv0, argv[optind],
+		        strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Reap children automatically */
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	sa.sin6_family = AF_INET6;
+	sa.sin6_port = htons(port);
+	sa.sin6_addr = in6addr_any;
+	if ((sfd = socket(AF_INET6, SOCK_STREAM, 0)) == -1
+	 || setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+	 || bind(sfd, (struct sockaddr *)&sa, sizeof(sa)) == -1
+	 || listen(sfd, 64) == -1)
+	{
+		fprintf(stderr, "%s: listen: %s\n", argv0, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		int cfd = accept(sfd, NULL, NULL);
+		if (cfd == -1) {
+			if (errno != EINTR)
+				fprintf(stderr, "%s: accept: %s\n", argv0, strerror(errno));
+			continue;
+		}
+
+		switch (fork()) {
+		case -1:
+			fprintf(stderr, "%s: fork: %s\n", argv0, strerror(errno));
+			break;
+		case 0:
+			close(sfd);
+			serve(cfd);
+			_exit(EXIT_SUCCESS);
+		}
+		close(cfd);
+	}
+}
+
+void
+serve(int fd)
+{
+	char hdr[MAXHDR + 1], method[8], path[1024], *end, *body;
+	size_t n = 0, bodysz = 0, have;
+	ssize_t nr;
+
+	do {
+		if (n == MAXHDR) {
+			reply(fd, 431, "Request Header Fields Too Large", NULL, 0);
+			return;
+		}
+		if ((nr = read(fd, hdr + n, MAXHDR - n)) <= 0)
+			return;
+		n += nr;
+		hdr[n] = 0;
+	} while ((end = strstr(hdr, "\r\n\r\n")) == NULL);
+
+	if (sscanf(hdr, "%7s %1023s HTTP/1.%*d", method, path) != 2) {
+		reply(fd, 400, "Bad Request", NULL, 0);
+		return;
+	}
+	if (!pathok(path)) {
+		reply(fd, 403, "Forbidden", NULL, 0);
+		return;
+	}
+
+	if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
+		struct stat sb;
+		int ffd = open(path + 1, O_RDONLY);
+		if (ffd == -1 || fstat(ffd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+			reply(fd, 404, "Not Found", NULL, 0);
+			return;
+		}
+
+		char buf[65536];
+		int hn = snprintf(buf, sizeof(buf),
+		                  "HTTP/1.1 200 OK\r\n"
+		                  "Content-Length: %jd\r\n"
+		                  "Connection: close\r\n\r\n",
+		                  (intmax_t)sb.st_size);
+		if (!sendall(fd, buf, hn) || method[0] == 'H')
+			return;
+		while ((nr = read(ffd, buf, sizeof(buf))) > 0) {
+			if (!sendall(fd, buf, nr))
+				return;
+		}
+		return;
+	}
+
+	if (strcmp(method, "PUT") != 0) {
+		reply(fd, 405, "Method Not Allowed", NULL, 0);
+		return;
+	}
+
+	for (char *h = strstr(hdr, "\r\n"); h != NULL && h < end;
+	     h = strstr(h + 2, "\r\n"))
+	{
+		if (strncasecmp(h + 2, "Content-Length:", 15) == 0)
+			bodysz = strtoull(h + 17, NULL, 10);
+	}
+	if (bodysz > MAXBODY) {
+		reply(fd, 413, "Content Too Large", NULL, 0);
+		return;
+	}
+
+	body = end + 4;
+	have = n - (body - hdr);
+	if (have > bodysz)
+		have = bodysz;
+
+	/* Write to a temporary file and rename it into place so that readers
+	   never observe a partially written entry */
+	char tmp[sizeof(path) + 32];
+	snprintf(tmp, sizeof(tmp), "%s.%jd.tmp", path + 1, (intmax_t)getpid());
+	int ffd;
+	if (!mkdirs(tmp)
+	 || (ffd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+	{
+		reply(fd, 500, "Internal Server Error", NULL, 0);
+		return;
+	}
+
+	bool ok = write(ffd, body, have) == (ssize_t)have;
+	for (size_t left = bodysz - have; ok && left > 0;) {
+		char buf[65536];
+		nr = read(fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+		ok = nr > 0 && write(ffd, buf, nr) == nr;
+		left -= nr;
+	}
+	ok = close(ffd) == 0 && ok;
+	if (!ok || rename(tmp, path + 1) == -1) {
+		unlink(tmp);
+		reply(fd, 500, "Internal Server Error", NULL, 0);
+		return;
+	}
+
+	reply(fd, 201, "Created", NULL, 0);
+}
+
+bool
+sendall(int fd, const void *p, size_t n)
+{
+	while (n > 0) {
+		ssize_t nw = write(fd, p, n);
+		if (nw <= 0)
+			return false;
+		p = (const char *)p + nw;
+		n -= nw;
+	}
+	return true;
+}
+
+void
+reply(int fd, int code, const char *msg, const char *body, size_t n)
+{
+	char buf[256];
+	int hn = snprintf(buf, sizeof(buf),
+	                  "HTTP/1.1 %d %s\r\n"
+	                  "Content-Length: %zu\r\n"
+	                  "Connection: close\r\n\r\n",
+	                  code, msg, n);
+	if (sendall(fd, buf, hn) && body != NULL)
+		sendall(fd, body, n);
+}
+
+/* Only allow absolute paths made of path components that cannot escape
+   the served directory */
+bool
+pathok(const char *p)
+{
+	if (*p++ != '/' || *p == 0)
+		return false;
+	for (const char *s = p; *s; s++) {
+		if (!(*s >= 'a' && *s <= 'z') && !(*s >= 'A' && *s <= 'Z')
+		 && !(*s >= '0' && *s <= '9') && !strchr("/-_.", *s))
+		{
+			return false;
+		}
+	}
+	for (;;) {
+		size_t n = strcspn(p, "/");
+		if (n == 0 || *p == '.')
+			return false;
+		if (p[n] == 0)
+			return true;
+		p += n + 1;
+	}
+}
+
+bool
+mkdirs(char *p)
+{
+	for (char *s = strchr(p, '/'); s != NULL; s = strchr(s + 1, '/')) {
+		*s = 0;
+		bool ok = mkdir(p, 0777) == 0 || errno == EEXIST;
+		*s = '/';
+		if (!ok)
+			return false;
+	}
+	return true;
+}
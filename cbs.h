@@ -19,22 +19,41 @@
 #define C_BUILD_SYSTEM_H
 
 #define _GNU_SOURCE
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#	include <sys/syscall.h>
+#endif
 
 #include <assert.h>
+#include <dirent.h>
+#include <elf.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <netdb.h>
+#include <poll.h>
 #ifndef CBS_NO_THREADS
 #	include <pthread.h>
 #endif
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
+#ifdef CBS_ZSTD
+#	include <zstd.h>
+#endif
 
 #define _vtoxs(...) ((char *[]){__VA_ARGS__})
 
@@ -45,6 +64,62 @@ struct strs {
 	size_t len, cap;
 };
 
+struct hash128 {
+	uint64_t lo, hi;
+};
+
+struct elf {
+	const unsigned char *buf;
+	size_t len;
+	bool is64, mapped;
+	uint64_t shoff;
+	size_t shnum, shentsize, shstrndx;
+};
+
+struct elfsec {
+	const char *name;
+	const void *data;
+	uint32_t type, link, info;
+	uint64_t flags, addr, size, entsize;
+};
+
+struct elfsym {
+	const char *name;
+	unsigned char bind, type, vis;
+	uint16_t shndx;
+	uint64_t value, size;
+};
+
+enum dglob_flags {
+	DG_RECURSE = 1 << 0,
+	DG_HIDDEN  = 1 << 1,
+};
+
+enum cc_kind {
+	CC_UNKNOWN,
+	CC_GCC,
+	CC_CLANG,
+};
+
+enum ld_kind {
+	LD_DEFAULT,
+	LD_GOLD,
+	LD_LLD,
+	LD_MOLD,
+};
+
+enum lto_mode {
+	LTO_NONE,
+	LTO_FULL,
+	LTO_THIN,
+};
+
+enum dbg_flags {
+	DBG_SPLIT    = 1 << 0,
+	DBG_COMPRESS = 1 << 1,
+	DBG_GDBINDEX = 1 << 2,
+};
+
 enum pkg_config_flags {
 	PC_CFLAGS = 1 << 0,
 	PC_LIBS   = 1 << 1,
@@ -52,9 +127,27 @@ enum pkg_config_flags {
 	PC_STATIC = 1 << 3,
 };
 
+struct cbsopts {
+	bool dryrun, keepgoing;
+	int jobs, shard, nshards;
+	struct strs tgts;
+};
+
 static void cbsinit(int, char **);
+static void cbsinit_at(int, char **);
 static void rebuild(const char *); /* Always call via macro wrapper */
 #define rebuild() rebuild(__FILE__)
+static void cbsparse(void);
+
+static bool tgtwanted(const char *);
+static void tgtdeps(const char *, char **, size_t);
+#define tgtdepsl(t, ...)                                                       \
+	tgtdeps((t), _vtoxs(__VA_ARGS__), lengthof(_vtoxs(__VA_ARGS__)))
+
+static bool shardmine(const char *);
+static void shardplan(char **, size_t);
+static void shardcost(const char *);
+static void shardrec(const char *, double);
 
 static void strsfree(struct strs *);
 static void strszero(struct strs *);
@@ -70,10 +163,35 @@ static int  fmdcmp(const char *, const char *);
 static bool fmdolder(const char *, const char *);
 static bool fmdnewer(const char *, const char *);
 static bool foutdated(const char *, char **, size_t);
+static bool depread(struct strs *, const char *);
 #define foutdatedl(s, ...)                                                     \
 	foutdated((s), _vtoxs(__VA_ARGS__), lengthof(_vtoxs(__VA_ARGS__)))
+static int  dcache(const char *);
+static bool mkdirp(const char *);
+static bool mkdirpf(const char *);
+
+static struct hash128 memhash(const void *, size_t);
+static bool fhash(const char *, struct hash128 *);
+static void fhcache(const char *);
+static bool soabi(const char *, const char *);
+
+static bool   elfopen(struct elf *, const char *);
+static bool   elfinit(struct elf *, const void *, size_t);
+static void   elfclose(struct elf *);
+static size_t elfnsec(const struct elf *);
+static bool   elfsec(const struct elf *, size_t, struct elfsec *);
+static size_t elfnsym(const struct elf *, const struct elfsec *);
+static bool   elfsym(const struct elf *, const struct elfsec *, size_t,
+                     struct elfsym *);
+
+static void dglob(struct strs *, const char *, int, char **, size_t);
+#define dglobl(xs, dir, flags, ...)                                            \
+	dglob((xs), (dir), (flags), _vtoxs(__VA_ARGS__),                           \
+	      lengthof(_vtoxs(__VA_ARGS__)))
+static void dgcache(const char *);
 
 static int   cmdexec(struct strs);
+static int   cmdexec_once(struct strs);
 static pid_t cmdexec_async(struct strs);
 static int   cmdexec_read(struct strs, char **, size_t *);
 static int   cmdwait(pid_t);
@@ -83,7 +201,20 @@ static void  cmdfput(FILE *, struct strs);
 static char *swpext(const char *, const char *);
 static bool  pcquery(struct strs *, const char *, int);
 static bool  binexists(const char *);
+static void  cachedir(const char *);
+static void  ccbase(const char *);
+static void  cachelimit(size_t);
+static void  cacheremote(const char *);
+static int   ccexec(struct strs, const char *, const char *, const char *);
+static int   ccbatch(struct strs, char **, char **, size_t);
 static int   nproc(void);
+static int   cckind(void);
+static void  ltoflags(struct strs *, int, size_t);
+static void  dbgflags(struct strs *, int);
+static void  dbgldflags(struct strs *, int);
+static int   ldprobe(void);
+static void  ldflags(struct strs *, size_t);
+static char *dwofile(const char *);
 
 #ifndef CBS_NO_THREADS
 typedef void tjob(void *);
@@ -93,26 +224,103 @@ struct _tqueue {
 	void *arg;
 	tjob *fn;
 	tjob_free *free;
-	struct _tqueue *next;
+	struct _tgroup *in;
+	struct _tres *res;
+	long long prio;
+	unsigned long long seq;
+	size_t waits;
+	bool skip;
+};
+
+struct _theap {
+	struct _tqueue **buf;
+	size_t len, cap;
+};
+
+typedef struct _tgroup {
+	bool failed;
+	size_t left;
+	struct _tqueue **wait;
+	size_t nwait, waitcap;
+} tgroup;
+
+typedef struct _tres {
+	size_t depth, busy;
+	struct _theap parked;
+	struct _tres *next;
+	struct _tpool *pool;
+} tres;
+
+struct tjobopts {
+	tgroup *after, *in, **afters;
+	size_t nafters;
+	tres *res;
+	long long prio;
 };
 
-typedef struct {
+typedef struct _tpool {
 	bool stop;
-	size_t tcnt, left;
+	size_t tcnt, left, busy, rsvd;
 	pthread_t *thrds;
 	pthread_cond_t cnd;
 	pthread_mutex_t mtx;
-	struct _tqueue *head, *tail;
+	struct _theap ready;
+	tres *parked;
+	unsigned long long seq;
 } tpool;
 
 static void tpinit(tpool *, size_t);
 static void tpfree(tpool *);
 static void tpwait(tpool *);
 static void tpenq(tpool *, tjob *, void *, tjob_free *);
+static void tpenqx(tpool *, tjob *, void *, tjob_free *, struct tjobopts);
+static bool tgwait(tpool *, tgroup *);
+static size_t tpreserve(tpool *, size_t);
+static void   tprelease(tpool *, size_t);
+static void tgfail(tgroup *);
+static long long tprio(const char *, char **, size_t);
+static void      tpfail(const char *, bool);
+static void      tpfailcache(const char *);
+#define tpriol(key, ...)                                                       \
+	tprio((key), _vtoxs(__VA_ARGS__), lengthof(_vtoxs(__VA_ARGS__)))
+
+static void    tpgen(tpool *, tgroup *, struct strs, char **, size_t);
+static tgroup *fgen(const char *);
+#define tpgenl(tp, tg, cmd, ...)                                               \
+	tpgen((tp), (tg), (cmd), _vtoxs(__VA_ARGS__),                              \
+	      lengthof(_vtoxs(__VA_ARGS__)))
+
+static void dglob_tp(tpool *, struct strs *, const char *, int, char **,
+                     size_t);
+#define dglob_tpl(tp, xs, dir, flags, ...)                                     \
+	dglob_tp((tp), (xs), (dir), (flags), _vtoxs(__VA_ARGS__),                  \
+	         lengthof(_vtoxs(__VA_ARGS__)))
+
+static bool fhashv(tpool *, char **, size_t, struct hash128 *);
+static void ccprefetch(tpool *, struct strs, const char *);
+
+struct testopts {
+	double timeout;
+	int shards;
+	tres *res;
+	char **ins, **env;
+	size_t nins, nenv;
+};
+
+static void testadd(const char *, struct strs, struct testopts);
+static bool testrun(tpool *, const char *);
+static void testcache(const char *);
 #endif /* !CBS_NO_THREADS */
 
+static struct cbsopts cbsopts;
+
 static int    _cbs_argc;
 static char **_cbs_argv;
+static int    _cbs_cwd = -1;
+static int    _cbs_dirfd = AT_FDCWD;
+static char  *_cbs_dirpath;
+static struct strs _cbs_tgtdeps, _cbs_tgtset;
+static size_t _cbs_tgtseen;
 
 /* Implementation */
 
@@ -125,6 +333,94 @@ static char **_cbs_argv;
 #	define st_mtim st_mtimespec
 #endif
 
+#ifdef CBS_NO_THREADS
+#	define _CBS_MUTEX(m)  static char m
+#	define _cbs_lock(m)   ((void)(m))
+#	define _cbs_unlock(m) ((void)(m))
+#else
+#	define _CBS_MUTEX(m)  static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER
+#	define _cbs_lock(m)   pthread_mutex_lock(&(m))
+#	define _cbs_unlock(m) pthread_mutex_unlock(&(m))
+#endif
+
+/* The persistent caches are read with _cbs_fload() when they are enabled
+   and written back with _cbs_fsave() when the process exits.  Other files
+   are replaced atomically with _cbs_writeall(). */
+static FILE *_cbs_fload(const char *);
+static void  _cbs_fsave(const char *, void (*)(FILE *));
+static bool  _cbs_writeall(const char *, const void *, size_t);
+
+/* A string-keyed hash map used by the various internal caches */
+struct _cbs_map {
+	struct _cbs_ment {
+		char *k;
+		void *v;
+	} *buf;
+	size_t len, cap;
+};
+
+static size_t
+_cbs_strhash(const char *s)
+{
+	uint64_t h = UINT64_C(14695981039346656037);
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= UINT64_C(1099511628211);
+	}
+	return (size_t)h;
+}
+
+/* Return a pointer to the value associated with the key k.  If k is not
+   in the map it is inserted with a NULL value when ins is true, otherwise
+   NULL is returned */
+static void **
+_cbs_mapget(struct _cbs_map *m, const char *k, bool ins)
+{
+	if (ins && (m->len + 1) * 4 >= m->cap * 3) {
+		struct _cbs_map n = {.cap = m->cap ? m->cap * 2 : 64};
+		n.buf = calloc(n.cap, sizeof(*n.buf));
+		assert(n.buf != NULL);
+		for (size_t i = 0; i < m->cap; i++) {
+			if (m->buf[i].k == NULL)
+				continue;
+			size_t j = _cbs_strhash(m->buf[i].k) & (n.cap - 1);
+			while (n.buf[j].k != NULL)
+				j = (j + 1) & (n.cap - 1);
+			n.buf[j] = m->buf[i];
+		}
+		n.len = m->len;
+		free(m->buf);
+		*m = n;
+	}
+
+	if (m->cap == 0)
+		return NULL;
+
+	size_t i = _cbs_strhash(k) & (m->cap - 1);
+	while (m->buf[i].k != NULL) {
+		if (strcmp(m->buf[i].k, k) == 0)
+			return &m->buf[i].v;
+		i = (i + 1) & (m->cap - 1);
+	}
+
+	if (!ins)
+		return NULL;
+	assert((m->buf[i].k = strdup(k)) != NULL);
+	m->buf[i].v = NULL;
+	m->len++;
+	return &m->buf[i].v;
+}
+
+/* Record the absolute path of the script directory, which is dir relative
+   to the working directory.  It is resolved up front, as the process may
+   not change its working directory once jobs are running. */
+static void
+_cbs_setdirpath(const char *dir)
+{
+	free(_cbs_dirpath);
+	assert((_cbs_dirpath = realpath(dir, NULL)) != NULL);
+}
+
 void
 cbsinit(int argc, char **argv)
 {
@@ -137,12 +433,43 @@ cbsinit(int argc, char **argv)
 	}
 	_cbs_argv[argc] = NULL;
 
+	_cbs_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
 	char *s = strrchr(_cbs_argv[0], '/');
 	if (s != NULL) {
 		s[0] = 0;
 		assert(chdir(_cbs_argv[0]) != -1);
 		s[0] = '/';
 	}
+	_cbs_setdirpath(".");
+}
+
+void
+cbsinit_at(int argc, char **argv)
+{
+	_cbs_argc = argc;
+	_cbs_argv = argv;
+	_cbs_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	char *s = strrchr(argv[0], '/');
+	if (s != NULL) {
+		char *dir = s == argv[0] ? strdup("/") : strndup(argv[0], s - argv[0]);
+		assert(dir != NULL);
+		_cbs_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		assert(_cbs_dirfd != -1);
+		_cbs_setdirpath(dir);
+		free(dir);
+	} else
+		_cbs_setdirpath(".");
+}
+
+/* Called in a freshly forked child before executing a command, so that
+   commands run in the script directory even when cbsinit_at() was used */
+static void
+_cbs_child(void)
+{
+	if (_cbs_dirfd != AT_FDCWD)
+		assert(fchdir(_cbs_dirfd) != -1);
 }
 
 void
@@ -169,6 +496,9 @@ void
 	strspushl(&xs, "-lpthread");
 #endif
 	strspushl(&xs, "-o", dst, src);
+#ifdef CBS_ZSTD
+	strspushl(&xs, "-lzstd");
+#endif
 	cmdput(xs);
 	assert(cmdexec(xs) == EXIT_SUCCESS);
 
@@ -176,6 +506,309 @@ void
 	assert(!"failed to execute process");
 }
 
+/* Parse a shard specification of the form ‘i/n’ */
+static bool
+_cbs_shardparse(const char *s)
+{
+	int i, n, off;
+	if (sscanf(s, "%d/%d%n", &i, &n, &off) != 2 || s[off] != 0 || n < 1
+	 || i < 0 || i >= n)
+	{
+		return false;
+	}
+	cbsopts.shard = i;
+	cbsopts.nshards = n;
+	return true;
+}
+
+void
+cbsparse(void)
+{
+	int opt;
+	char *p;
+	long n;
+
+	cbsopts.jobs = nproc();
+	if (cbsopts.jobs == -1)
+		cbsopts.jobs = 8;
+
+	if ((p = getenv("CBS_SHARD")) != NULL && *p != 0 && !_cbs_shardparse(p)) {
+		fprintf(stderr, "%s: invalid shard in $CBS_SHARD: %s\n", *_cbs_argv, p);
+		exit(EXIT_FAILURE);
+	}
+
+	optind = 1;
+	while ((opt = getopt(_cbs_argc, _cbs_argv, "C:j:kns:")) != -1) {
+		switch (opt) {
+		case 'C':
+			if (_cbs_dirfd != AT_FDCWD) {
+				int fd = openat(_cbs_cwd, optarg,
+				                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				if (fd == -1) {
+					fprintf(stderr, "%s: open: %s: %s\n", *_cbs_argv, optarg,
+					        strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+				close(_cbs_dirfd);
+				_cbs_dirfd = fd;
+				_cbs_setdirpath(optarg);
+				break;
+			}
+			if (_cbs_cwd != -1)
+				assert(fchdir(_cbs_cwd) != -1);
+			if (chdir(optarg) == -1) {
+				fprintf(stderr, "%s: chdir: %s: %s\n", *_cbs_argv, optarg,
+				        strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			_cbs_setdirpath(".");
+			break;
+		case 'j':
+			errno = 0;
+			n = strtol(optarg, &p, 10);
+			if (*optarg == 0 || *p != 0 || errno != 0 || n < 1 || n > INT_MAX) {
+				fprintf(stderr, "%s: invalid job count: %s\n", *_cbs_argv,
+				        optarg);
+				exit(EXIT_FAILURE);
+			}
+			cbsopts.jobs = (int)n;
+			break;
+		case 'k':
+			cbsopts.keepgoing = true;
+			break;
+		case 'n':
+			cbsopts.dryrun = true;
+			break;
+		case 's':
+			if (!_cbs_shardparse(optarg)) {
+				fprintf(stderr, "%s: invalid shard: %s\n", *_cbs_argv, optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			fprintf(stderr,
+			        "Usage: %s [-kn] [-C dir] [-j jobs] [-s shard/count] "
+			        "[target ...]\n",
+			        *_cbs_argv);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	strspush(&cbsopts.tgts, _cbs_argv + optind, _cbs_argc - optind);
+}
+
+static bool
+_strshas(struct strs xs, const char *s)
+{
+	for (size_t i = 0; i < xs.len; i++) {
+		if (strcmp(xs.buf[i], s) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool
+tgtwanted(const char *tgt)
+{
+	if (cbsopts.tgts.len == 0)
+		return true;
+
+	/* Recompute the closure of the requested targets only when new
+	   dependencies have been declared since the last query */
+	if (_cbs_tgtseen != _cbs_tgtdeps.len || _cbs_tgtset.len == 0) {
+		strszero(&_cbs_tgtset);
+		strspush(&_cbs_tgtset, cbsopts.tgts.buf, cbsopts.tgts.len);
+		for (size_t i = 0; i < _cbs_tgtset.len; i++) {
+			for (size_t j = 0; j < _cbs_tgtdeps.len; j += 2) {
+				char *from = _cbs_tgtdeps.buf[j], *to = _cbs_tgtdeps.buf[j + 1];
+				if (strcmp(from, _cbs_tgtset.buf[i]) == 0
+				 && !_strshas(_cbs_tgtset, to))
+				{
+					strspushl(&_cbs_tgtset, to);
+				}
+			}
+		}
+		_cbs_tgtseen = _cbs_tgtdeps.len;
+	}
+
+	return _strshas(_cbs_tgtset, tgt);
+}
+
+void
+tgtdeps(const char *tgt, char **deps, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		strspushl(&_cbs_tgtdeps, (char *)tgt, deps[i]);
+}
+
+/* Shards assigned by shardplan() are stored off by one, so that a null
+   value means the key was never planned */
+static struct _cbs_map _cbs_shmap, _cbs_costmap;
+static char *_cbs_costpath;
+
+/* Costs remember when they were recorded, so that the histories of several
+   shards can be combined in any order with the newest cost of each action
+   winning */
+struct _cbs_cost {
+	double secs;
+	long long when;
+};
+
+static bool  _cbs_costdirty;
+_CBS_MUTEX(_cbs_shmtx);
+
+bool
+shardmine(const char *key)
+{
+	if (cbsopts.nshards <= 1)
+		return true;
+
+	_cbs_lock(_cbs_shmtx);
+	void **v = _cbs_mapget(&_cbs_shmap, key, false);
+	int shard = v != NULL ? (int)(intptr_t)*v - 1 : -1;
+	_cbs_unlock(_cbs_shmtx);
+
+	/* Unplanned keys are spread by a hash that is the same on every
+	   machine, so all shards agree on who builds what */
+	if (shard == -1) {
+		struct hash128 h = memhash(key, strlen(key));
+		shard = (int)(h.lo % (uint64_t)cbsopts.nshards);
+	}
+	return shard == cbsopts.shard;
+}
+
+struct _cbs_shjob {
+	const char *key;
+	double cost;
+};
+
+static int
+_cbs_shjobcmp(const void *x, const void *y)
+{
+	const struct _cbs_shjob *a = x, *b = y;
+	if (a->cost != b->cost)
+		return a->cost < b->cost ? 1 : -1;
+	return strcmp(a->key, b->key);
+}
+
+void
+shardplan(char **keys, size_t n)
+{
+	struct _cbs_shjob *js;
+	double *loads, sum = 0;
+	size_t known = 0;
+
+	if (cbsopts.nshards <= 1 || n == 0)
+		return;
+
+	assert((js = malloc(n * sizeof(*js))) != NULL);
+	assert((loads = calloc(cbsopts.nshards, sizeof(*loads))) != NULL);
+
+	_cbs_lock(_cbs_shmtx);
+	for (size_t i = 0; i < n; i++) {
+		void **v = _cbs_mapget(&_cbs_costmap, keys[i], false);
+		js[i].key = keys[i];
+		js[i].cost = v != NULL ? ((struct _cbs_cost *)*v)->secs : -1;
+		if (v != NULL) {
+			sum += js[i].cost;
+			known++;
+		}
+	}
+
+	/* Jobs without a history are assumed to be average */
+	for (size_t i = 0; i < n; i++) {
+		if (js[i].cost < 0)
+			js[i].cost = known > 0 ? sum / known : 1;
+	}
+
+	/* Longest processing time first: hand each job, from the most to the
+	   least expensive, to the least loaded shard */
+	qsort(js, n, sizeof(*js), _cbs_shjobcmp);
+	for (size_t i = 0; i < n; i++) {
+		int min = 0;
+		for (int j = 1; j < cbsopts.nshards; j++) {
+			if (loads[j] < loads[min])
+				min = j;
+		}
+		loads[min] += js[i].cost;
+		*_cbs_mapget(&_cbs_shmap, js[i].key, true) = (void *)(intptr_t)(min + 1);
+	}
+	_cbs_unlock(_cbs_shmtx);
+
+	free(loads);
+	free(js);
+}
+
+void
+shardrec(const char *key, double secs)
+{
+	_cbs_lock(_cbs_shmtx);
+	void **v = _cbs_mapget(&_cbs_costmap, key, true);
+	if (*v == NULL)
+		assert((*v = malloc(sizeof(struct _cbs_cost))) != NULL);
+	*(struct _cbs_cost *)*v = (struct _cbs_cost){secs, (long long)time(NULL)};
+	_cbs_costdirty = true;
+	_cbs_unlock(_cbs_shmtx);
+}
+
+static void
+_cbs_costwrite(FILE *fp)
+{
+	fputs("cbs-cost 2\n", fp);
+	for (size_t i = 0; i < _cbs_costmap.cap; i++) {
+		struct _cbs_cost *c = _cbs_costmap.buf[i].v;
+		if (_cbs_costmap.buf[i].k != NULL)
+			fprintf(fp, "%.6f %lld %s\n", c->secs, c->when, _cbs_costmap.buf[i].k);
+	}
+}
+
+static void
+_cbs_costsave(void)
+{
+	if (_cbs_costdirty)
+		_cbs_fsave(_cbs_costpath, _cbs_costwrite);
+}
+
+void
+shardcost(const char *path)
+{
+	FILE *fp;
+	char buf[PATH_MAX + 64];
+
+	_cbs_lock(_cbs_shmtx);
+	if (_cbs_costpath == NULL)
+		atexit(_cbs_costsave);
+	free(_cbs_costpath);
+	assert((_cbs_costpath = strdup(path)) != NULL);
+
+	if ((fp = _cbs_fload(path)) == NULL) {
+		_cbs_unlock(_cbs_shmtx);
+		return;
+	}
+
+	/* Histories of several shards may be concatenated, in which case the
+	   most recently recorded cost of each action wins */
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		struct _cbs_cost c;
+		int off;
+
+		buf[strcspn(buf, "\n")] = 0;
+		if (strcmp(buf, "cbs-cost 2") == 0)
+			continue;
+		if (sscanf(buf, "%lf %lld %n", &c.secs, &c.when, &off) != 2 || c.secs < 0)
+			break;
+
+		void **v = _cbs_mapget(&_cbs_costmap, buf + off, true);
+		if (*v == NULL)
+			assert((*v = malloc(sizeof(c))) != NULL);
+		else if (((struct _cbs_cost *)*v)->when > c.when)
+			continue;
+		*(struct _cbs_cost *)*v = c;
+	}
+	fclose(fp);
+	_cbs_unlock(_cbs_shmtx);
+}
+
 void
 strsfree(struct strs *xs)
 {
@@ -233,10 +866,156 @@ strspushenv(struct strs *xs, const char *ev, char **ys, size_t n)
 	wordfree(&we);
 }
 
+_CBS_MUTEX(_cbs_dcmtx);
+static struct _cbs_map _cbs_dcmap;
+
+int
+dcache(const char *dir)
+{
+	int fd;
+	void **v;
+
+	_cbs_lock(_cbs_dcmtx);
+	if ((v = _cbs_mapget(&_cbs_dcmap, dir, false)) != NULL) {
+		fd = (int)(intptr_t)*v;
+		_cbs_unlock(_cbs_dcmtx);
+		return fd;
+	}
+
+	/* Missing directories are not cached, as they may yet be created */
+	if ((fd = openat(_cbs_dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1)
+		*_cbs_mapget(&_cbs_dcmap, dir, true) = (void *)(intptr_t)fd;
+	_cbs_unlock(_cbs_dcmtx);
+	return fd;
+}
+
+/* If the parent directory of the file f was cached with dcache(), return
+   its descriptor and store the final path component of f in name, so that
+   only that component needs resolving.  Otherwise f is resolved in full.
+   Directories are never cached implicitly, as a large tree would run the
+   process out of file descriptors. */
+static int
+_cbs_at(const char *f, const char **name)
+{
+	char dir[PATH_MAX];
+	const char *base = strrchr(f, '/');
+	size_t n;
+	void **v;
+	int fd = _cbs_dirfd;
+
+	*name = f;
+	if (base == NULL || base[1] == 0)
+		return _cbs_dirfd;
+	if ((n = base - f) == 0)
+		n = 1;
+	if (n >= sizeof(dir))
+		return _cbs_dirfd;
+
+	memcpy(dir, f, n);
+	dir[n] = 0;
+
+	_cbs_lock(_cbs_dcmtx);
+	if ((v = _cbs_mapget(&_cbs_dcmap, dir, false)) != NULL) {
+		fd = (int)(intptr_t)*v;
+		*name = base + 1;
+	}
+	_cbs_unlock(_cbs_dcmtx);
+	return fd;
+}
+
+static int
+_cbs_stat(const char *f, struct stat *sb)
+{
+	int fd = _cbs_at(f, &f);
+	return fstatat(fd, f, sb, 0);
+}
+
+static int
+_cbs_open(const char *f, int flags)
+{
+	int fd = _cbs_at(f, &f);
+	return openat(fd, f, flags | O_CLOEXEC, 0666);
+}
+
+_CBS_MUTEX(_cbs_mdmtx);
+static struct _cbs_map _cbs_mdmap;
+
+bool
+mkdirp(const char *dir)
+{
+	char buf[PATH_MAX];
+	size_t n = strlen(dir);
+
+	while (n > 1 && dir[n - 1] == '/')
+		n--;
+	if (n == 0 || n >= sizeof(buf)) {
+		errno = n == 0 ? ENOENT : ENAMETOOLONG;
+		return false;
+	}
+	memcpy(buf, dir, n);
+	buf[n] = 0;
+
+	/* The lock is held while creating directories so that every directory
+	   is created exactly once, no matter how many threads ask for it */
+	_cbs_lock(_cbs_mdmtx);
+	if (_cbs_mapget(&_cbs_mdmap, buf, false) != NULL) {
+		_cbs_unlock(_cbs_mdmtx);
+		return true;
+	}
+
+	/* Find the deepest ancestor we already created, and create everything
+	   below it */
+	char *p = buf + n;
+	while (--p > buf) {
+		if (*p != '/')
+			continue;
+		*p = 0;
+		bool done = _cbs_mapget(&_cbs_mdmap, buf, false) != NULL;
+		*p = '/';
+		if (done)
+			break;
+	}
+
+	for (p = *p == '/' ? p + 1 : p;; p++) {
+		if (*p != '/' && *p != 0)
+			continue;
+		char c = *p;
+		*p = 0;
+		if (mkdirat(_cbs_dirfd, buf, 0777) == -1 && errno != EEXIST) {
+			_cbs_unlock(_cbs_mdmtx);
+			return false;
+		}
+		_cbs_mapget(&_cbs_mdmap, buf, true);
+		if ((*p = c) == 0)
+			break;
+	}
+
+	_cbs_unlock(_cbs_mdmtx);
+	return true;
+}
+
+bool
+mkdirpf(const char *file)
+{
+	char buf[PATH_MAX];
+	const char *p = strrchr(file, '/');
+
+	if (p == NULL || p == file)
+		return true;
+	if ((size_t)(p - file) >= sizeof(buf)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	memcpy(buf, file, p - file);
+	buf[p - file] = 0;
+	return mkdirp(buf);
+}
+
 bool
 fexists(const char *f)
 {
-	return !access(f, F_OK);
+	struct stat sb;
+	return _cbs_stat(f, &sb) != -1;
 }
 
 int
@@ -245,8 +1024,9 @@ fmdcmp(const char *lhs, const char *rhs)
 	int errnol, errnor;
 	struct stat sbl, sbr;
 
-	stat(lhs, &sbl); errnol = errno; errno = 0;
-	stat(rhs, &sbr); errnor = errno;
+	errno = 0;
+	_cbs_stat(lhs, &sbl); errnol = errno; errno = 0;
+	_cbs_stat(rhs, &sbr); errnor = errno;
 
 	assert(errnol == 0 || errnol == ENOENT);
 	assert(errnor == 0 || errnor == ENOENT);
@@ -285,30 +1065,110 @@ foutdated(const char *src, char **deps, size_t n)
 	return false;
 }
 
-int
-cmdexec(struct strs xs)
+bool
+depread(struct strs *xs, const char *f)
 {
-	flockfile(stderr);
-	int ret = cmdwait(cmdexec_async(xs));
-	funlockfile(stderr);
-	return ret;
-}
+	int fd;
+	struct stat sb;
 
-pid_t
-cmdexec_async(struct strs xs)
-{
-	pid_t pid = fork();
-	assert(pid != -1);
-	if (pid == 0) {
-		execvp(xs.buf[0], xs.buf);
-		assert(!"failed to execute process");
+	if ((fd = _cbs_open(f, O_RDONLY)) == -1)
+		return false;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return false;
 	}
-	return pid;
-}
 
-int
-cmdexec_read(struct strs xs, char **p, size_t *n)
-{
+	char *buf = malloc(sb.st_size + 1), *p, *end;
+	assert(buf != NULL);
+	ssize_t nr = 0;
+	for (ssize_t m; nr < sb.st_size; nr += m) {
+		if ((m = read(fd, buf + nr, sb.st_size - nr)) <= 0)
+			break;
+	}
+	close(fd);
+	buf[nr] = 0;
+	end = buf + nr;
+
+	/* Skip the targets of the first rule.  The ‘:’ must be followed by
+	   whitespace so that Windows drive letters aren’t mistaken for it. */
+	for (p = buf; p < end; p++) {
+		if (*p == '\\' && p + 1 < end)
+			p++;
+		else if (*p == ':' && (p + 1 == end || strchr(" \t\r\n", p[1])))
+			break;
+	}
+	if (p++ == end) {
+		free(buf);
+		return false;
+	}
+
+	/* Parse the prerequisites up until the first unescaped newline */
+	char *w = malloc(end - p + 1);
+	assert(w != NULL);
+	for (size_t n = 0;; p++) {
+		bool sep = p == end || *p == ' ' || *p == '\t' || *p == '\r'
+		        || *p == '\n';
+		if (sep && n > 0) {
+			w[n] = 0;
+			char *s = strdup(w);
+			assert(s != NULL);
+			strspushl(xs, s);
+			n = 0;
+		}
+		if (p == end || *p == '\n')
+			break;
+		if (sep)
+			continue;
+
+		if (*p == '\\' && p + 1 < end && p[1] == '\n')
+			p++;
+		else if (*p == '\\' && p + 1 < end && p[1] == '\r' && p + 2 < end
+		      && p[2] == '\n')
+		{
+			p += 2;
+		} else if (*p == '\\' && p + 1 < end && (p[1] == ' ' || p[1] == '#'))
+			w[n++] = *++p;
+		else if (*p == '$' && p + 1 < end && p[1] == '$')
+			w[n++] = *++p;
+		else
+			w[n++] = *p;
+	}
+
+	free(w);
+	free(buf);
+	return true;
+}
+
+int
+cmdexec(struct strs xs)
+{
+	if (cbsopts.dryrun)
+		return EXIT_SUCCESS;
+
+	flockfile(stderr);
+	int ret = cmdwait(cmdexec_async(xs));
+	funlockfile(stderr);
+	return ret;
+}
+
+pid_t
+cmdexec_async(struct strs xs)
+{
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		if (cbsopts.dryrun)
+			_exit(EXIT_SUCCESS);
+		_cbs_child();
+		execvp(xs.buf[0], xs.buf);
+		assert(!"failed to execute process");
+	}
+	return pid;
+}
+
+int
+cmdexec_read(struct strs xs, char **p, size_t *n)
+{
 	enum {
 		R,
 		W,
@@ -324,6 +1184,7 @@ cmdexec_read(struct strs xs, char **p, size_t *n)
 		close(fds[R]);
 		close(STDOUT_FILENO);
 		assert(dup2(fds[W], STDOUT_FILENO) != -1);
+		_cbs_child();
 		execvp(xs.buf[0], xs.buf);
 		assert(!"failed to execute process");
 	}
@@ -494,6 +1355,189 @@ nproc(void)
 #endif
 }
 
+_CBS_MUTEX(_cbs_ccmtx);
+
+int
+cckind(void)
+{
+	static int kind = -1;
+
+	_cbs_lock(_cbs_ccmtx);
+	if (kind == -1) {
+		char *buf;
+		size_t bufsz;
+		struct strs xs = {0};
+
+		kind = CC_UNKNOWN;
+		strspushenvl(&xs, "CC", "cc");
+		strspushl(&xs, "--version");
+		if (cmdexec_read(xs, &buf, &bufsz) == EXIT_SUCCESS && buf != NULL) {
+			buf[bufsz] = 0;
+			if (strstr(buf, "clang") != NULL)
+				kind = CC_CLANG;
+			else if (strstr(buf, "Free Software Foundation") != NULL)
+				kind = CC_GCC;
+		}
+		free(buf);
+		strsfree(&xs);
+	}
+	_cbs_unlock(_cbs_ccmtx);
+	return kind;
+}
+
+_CBS_MUTEX(_cbs_fmtmtx);
+static struct _cbs_map _cbs_fmtmap;
+
+/* Return the flag fmt formatted with n.  Flags are interned, so that
+   functions pushing them into a caller’s strs don’t leak a copy on every
+   call; the string must not be freed. */
+static char *
+_cbs_fmt(const char *fmt, size_t n)
+{
+	char buf[128], *s;
+	void **v;
+
+	snprintf(buf, sizeof(buf), fmt, n);
+	_cbs_lock(_cbs_fmtmtx);
+	if (*(v = _cbs_mapget(&_cbs_fmtmap, buf, true)) == NULL)
+		assert((*v = strdup(buf)) != NULL);
+	s = *v;
+	_cbs_unlock(_cbs_fmtmtx);
+	return s;
+}
+
+void
+ltoflags(struct strs *xs, int mode, size_t jobs)
+{
+	if (mode == LTO_NONE)
+		return;
+	if (jobs == 0)
+		jobs = 1;
+
+	switch (cckind()) {
+	case CC_GCC:
+		/* GCC has no equivalent of ThinLTO, but partitions the program so
+		   that the link-time code generation runs in parallel */
+		strspushl(xs, _cbs_fmt("-flto=%zu", jobs));
+		if (jobs == 1)
+			strspushl(xs, "-flto-partition=one");
+		break;
+	case CC_CLANG:
+		if (mode == LTO_THIN)
+			strspushl(xs, "-flto=thin", _cbs_fmt("-flto-jobs=%zu", jobs));
+		else
+			strspushl(xs, "-flto=full");
+		break;
+	default:
+		strspushl(xs, "-flto");
+	}
+}
+
+/* Execute the command xs with its standard output and error discarded */
+static int
+_cbs_cmdquiet(struct strs xs)
+{
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+		if (fd != -1) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		_cbs_child();
+		execvp(xs.buf[0], xs.buf);
+		_exit(127);
+	}
+	return cmdwait(pid);
+}
+
+int
+ldprobe(void)
+{
+	static int kind = -1;
+	static const struct {
+		int kind;
+		char *name, *flag;
+	} lds[] = {
+		{LD_MOLD, "mold",    "-fuse-ld=mold"},
+		{LD_LLD,  "ld.lld",  "-fuse-ld=lld"},
+		{LD_GOLD, "ld.gold", "-fuse-ld=gold"},
+	};
+
+	_cbs_lock(_cbs_ccmtx);
+	if (kind == -1) {
+		kind = LD_DEFAULT;
+
+		/* The compiler driver might not know about a linker even if it is
+		   installed, so ask it to run the linker */
+		for (size_t i = 0; i < lengthof(lds); i++) {
+			if (!binexists(lds[i].name))
+				continue;
+
+			struct strs xs = {0};
+			strspushenvl(&xs, "CC", "cc");
+			strspushl(&xs, lds[i].flag, "-Wl,--version");
+			int ec = _cbs_cmdquiet(xs);
+			strsfree(&xs);
+			if (ec == EXIT_SUCCESS) {
+				kind = lds[i].kind;
+				break;
+			}
+		}
+	}
+	_cbs_unlock(_cbs_ccmtx);
+	return kind;
+}
+
+void
+ldflags(struct strs *xs, size_t jobs)
+{
+	switch (ldprobe()) {
+	case LD_MOLD:
+		strspushl(xs, "-fuse-ld=mold");
+		if (jobs > 0)
+			strspushl(xs, _cbs_fmt("-Wl,--thread-count=%zu", jobs));
+		break;
+	case LD_LLD:
+		strspushl(xs, "-fuse-ld=lld");
+		if (jobs > 0)
+			strspushl(xs, _cbs_fmt("-Wl,--threads=%zu", jobs));
+		break;
+	case LD_GOLD:
+		strspushl(xs, "-fuse-ld=gold");
+		if (jobs > 0) {
+			strspushl(xs, "-Wl,--threads",
+			          _cbs_fmt("-Wl,--thread-count=%zu", jobs));
+		}
+		break;
+	}
+}
+
+void
+dbgflags(struct strs *xs, int flags)
+{
+	strspushl(xs, "-g");
+	if (flags & DBG_SPLIT)
+		strspushl(xs, "-gsplit-dwarf");
+	if (flags & DBG_COMPRESS)
+		strspushl(xs, "-gz");
+}
+
+void
+dbgldflags(struct strs *xs, int flags)
+{
+	dbgflags(xs, flags);
+	if (flags & DBG_GDBINDEX)
+		strspushl(xs, "-Wl,--gdb-index");
+}
+
+char *
+dwofile(const char *obj)
+{
+	return swpext(obj, "dwo");
+}
+
 char *
 swpext(const char *file, const char *ext)
 {
@@ -512,18 +1556,169 @@ swpext(const char *file, const char *ext)
 }
 
 #ifndef CBS_NO_THREADS
+/* Runnable jobs are kept in binary heaps ordered by priority, with jobs of
+   equal priority in the order they were enqueued */
+static bool
+_thbefore(struct _tqueue *x, struct _tqueue *y)
+{
+	return x->prio != y->prio ? x->prio > y->prio : x->seq < y->seq;
+}
+
+static void
+_thpush(struct _theap *h, struct _tqueue *q)
+{
+	size_t i;
+
+	if (h->len == h->cap) {
+		h->cap = h->cap == 0 ? 64 : h->cap * 2;
+		h->buf = realloc(h->buf, h->cap * sizeof(*h->buf));
+		assert(h->buf != NULL);
+	}
+	for (i = h->len++; i > 0 && _thbefore(q, h->buf[(i - 1) / 2]); i = (i - 1) / 2)
+		h->buf[i] = h->buf[(i - 1) / 2];
+	h->buf[i] = q;
+}
+
+static struct _tqueue *
+_thpop(struct _theap *h)
+{
+	struct _tqueue *top, *q;
+	size_t i = 0;
+
+	if (h->len == 0)
+		return NULL;
+	top = h->buf[0];
+	q = h->buf[--h->len];
+	for (size_t c; (c = 2 * i + 1) < h->len; i = c) {
+		if (c + 1 < h->len && _thbefore(h->buf[c + 1], h->buf[c]))
+			c++;
+		if (!_thbefore(h->buf[c], q))
+			break;
+		h->buf[i] = h->buf[c];
+	}
+	if (h->len > 0)
+		h->buf[i] = q;
+	return top;
+}
+
+static void
+_tppush(tpool *tp, struct _tqueue *q)
+{
+	_thpush(&tp->ready, q);
+}
+
+/* Dequeue the next job whose resource pool isn’t full, or return NULL if
+   there is no such job.  Jobs of a full pool are parked in a heap of their
+   own until one of the pool’s jobs finishes (see _tpunpark()), so that they
+   aren’t looked at again on every dequeue. */
 static struct _tqueue *
-_tpdeq(tpool *tp)
+_tpnext(tpool *tp)
+{
+	struct _tqueue *q;
+
+	while ((q = _thpop(&tp->ready)) != NULL) {
+		tres *r = q->res;
+		if (r == NULL || r->depth == 0 || r->busy < r->depth) {
+			if (r != NULL)
+				r->busy++;
+			return q;
+		}
+		/* A resource pool can only park jobs of one thread pool at a
+		   time, as it is linked into that pool’s list */
+		assert(r->pool == NULL || r->pool == tp);
+		if (r->pool == NULL) {
+			r->pool = tp;
+			r->next = tp->parked;
+			tp->parked = r;
+		}
+		_thpush(&r->parked, q);
+	}
+	return NULL;
+}
+
+/* Unlink the resource pool r from the parked list of tp and release its
+   heap, so that nothing refers to r once it has no parked jobs left */
+static void
+_tpunlist(tpool *tp, tres *r)
+{
+	tres **p;
+
+	for (p = &tp->parked; *p != r; p = &(*p)->next)
+		assert(*p != NULL);
+	*p = r->next;
+	free(r->parked.buf);
+	r->parked = (struct _theap){0};
+	r->next = NULL;
+	r->pool = NULL;
+}
+
+/* Called with the pool locked when a job of the resource pool r finished,
+   making the next parked job of r runnable again */
+static void
+_tpunpark(tpool *tp, tres *r)
 {
-	struct _tqueue *q = tp->head;
+	struct _tqueue *q;
 
-	if (q != NULL) {
-		tp->head = tp->head->next;
-		if (!tp->head)
-			tp->tail = NULL;
+	r->busy--;
+	if ((q = _thpop(&r->parked)) != NULL)
+		_tppush(tp, q);
+	if (r->pool == tp && r->parked.len == 0)
+		_tpunlist(tp, r);
+}
+
+_CBS_MUTEX(_cbs_tgmtx);
+
+static bool
+_tgfailed(tgroup *tg)
+{
+	_cbs_lock(_cbs_tgmtx);
+	bool failed = tg->failed;
+	_cbs_unlock(_cbs_tgmtx);
+	return failed;
+}
+
+static void _tgdone(tpool *, tgroup *);
+
+/* Drop the job q without running it because a group it waits on failed.
+   Must be called with the pool locked. */
+static void
+_tpskip(tpool *tp, struct _tqueue *q)
+{
+	if (q->free)
+		q->free(q->arg);
+	tp->left--;
+	if (q->in != NULL) {
+		tgfail(q->in);
+		if (--q->in->left == 0)
+			_tgdone(tp, q->in);
 	}
+	free(q);
+}
+
+/* Called with the pool locked once the last job of the group tg finished.
+   The jobs waiting on tg become runnable once every group they wait on has
+   finished, or are dropped if any of those groups failed. */
+static void
+_tgdone(tpool *tp, tgroup *tg)
+{
+	struct _tqueue **w = tg->wait;
+	size_t n = tg->nwait;
+	bool failed = _tgfailed(tg);
+
+	tg->wait = NULL;
+	tg->nwait = tg->waitcap = 0;
 
-	return q;
+	for (size_t i = 0; i < n; i++) {
+		struct _tqueue *q = w[i];
+		q->skip = q->skip || failed;
+		if (--q->waits > 0)
+			continue;
+		if (q->skip)
+			_tpskip(tp, q);
+		else
+			_tppush(tp, q);
+	}
+	free(w);
 }
 
 static void *
@@ -534,26 +1729,37 @@ _tpwork(void *arg)
 	while (!tp->stop) {
 		struct _tqueue *q;
 
+		/* Threads reserved by tpreserve() are kept idle */
 		pthread_mutex_lock(&tp->mtx);
-		while (!tp->stop && !tp->head)
+		while (!tp->stop && (tp->busy + tp->rsvd >= tp->tcnt
+		                     || (q = _tpnext(tp)) == NULL))
+		{
 			pthread_cond_wait(&tp->cnd, &tp->mtx);
+		}
 		if (tp->stop) {
 			pthread_mutex_unlock(&tp->mtx);
 			break;
 		}
 
-		q = _tpdeq(tp);
+		tp->busy++;
 		pthread_mutex_unlock(&tp->mtx);
 
 		q->fn(q->arg);
 		if (q->free)
 			q->free(q->arg);
-		free(q);
 
 		pthread_mutex_lock(&tp->mtx);
 		tp->left--;
+		tp->busy--;
+		if (q->res != NULL)
+			_tpunpark(tp, q->res);
+		/* Once the last job of a group finishes, the jobs waiting on the
+		   group become runnable */
+		if (q->in != NULL && --q->in->left == 0)
+			_tgdone(tp, q->in);
 		pthread_cond_broadcast(&tp->cnd);
 		pthread_mutex_unlock(&tp->mtx);
+		free(q);
 	}
 
 	return NULL;
@@ -564,8 +1770,10 @@ tpinit(tpool *tp, size_t n)
 {
 	tp->tcnt = n;
 	tp->stop = false;
-	tp->left = 0;
-	tp->head = tp->tail = NULL;
+	tp->left = tp->busy = tp->rsvd = 0;
+	tp->ready = (struct _theap){0};
+	tp->parked = NULL;
+	tp->seq = 0;
 	tp->thrds = malloc(sizeof(pthread_t) * n);
 	assert(tp->thrds != NULL);
 	pthread_cond_init(&tp->cnd, NULL);
@@ -587,12 +1795,18 @@ tpfree(tpool *tp)
 		pthread_join(tp->thrds[i], NULL);
 
 	free(tp->thrds);
-	while (tp->head != NULL) {
-		struct _tqueue *q = _tpdeq(tp);
+	while (tp->parked != NULL) {
+		tres *r = tp->parked;
+		while (r->parked.len > 0)
+			_tppush(tp, _thpop(&r->parked));
+		_tpunlist(tp, r);
+	}
+	for (struct _tqueue *q; (q = _thpop(&tp->ready)) != NULL;) {
 		if (q->free)
 			q->free(q->arg);
 		free(q);
 	}
+	free(tp->ready.buf);
 
 	pthread_cond_destroy(&tp->cnd);
 	pthread_mutex_destroy(&tp->mtx);
@@ -609,6 +1823,12 @@ tpwait(tpool *tp)
 
 void
 tpenq(tpool *tp, tjob *fn, void *arg, tjob_free *free)
+{
+	tpenqx(tp, fn, arg, free, (struct tjobopts){0});
+}
+
+void
+tpenqx(tpool *tp, tjob *fn, void *arg, tjob_free *free, struct tjobopts o)
 {
 	struct _tqueue *q = malloc(sizeof(*q));
 	assert(q != NULL);
@@ -616,20 +1836,3545 @@ tpenq(tpool *tp, tjob *fn, void *arg, tjob_free *free)
 		.fn   = fn,
 		.arg  = arg,
 		.free = free,
+		.in   = o.in,
+		.res  = o.res,
+		.prio = o.prio,
 	};
 
 	pthread_mutex_lock(&tp->mtx);
-	if (tp->tail)
-		tp->tail->next = q;
-	if (!tp->head)
-		tp->head = q;
-	tp->tail = q;
+	q->seq = tp->seq++;
 	tp->left++;
-	pthread_cond_signal(&tp->cnd);
+	if (o.in != NULL)
+		o.in->left++;
+	for (size_t i = 0; i <= o.nafters; i++) {
+		tgroup *tg = i < o.nafters ? o.afters[i] : o.after;
+		if (tg == NULL)
+			continue;
+		if (tg->left == 0) {
+			q->skip = q->skip || _tgfailed(tg);
+			continue;
+		}
+		if (tg->nwait == tg->waitcap) {
+			tg->waitcap = tg->waitcap == 0 ? 8 : tg->waitcap * 2;
+			tg->wait = realloc(tg->wait, tg->waitcap * sizeof(*tg->wait));
+			assert(tg->wait != NULL);
+		}
+		tg->wait[tg->nwait++] = q;
+		q->waits++;
+	}
+
+	if (q->waits == 0 && q->skip) {
+		_tpskip(tp, q);
+		pthread_cond_broadcast(&tp->cnd);
+	} else if (q->waits == 0) {
+		_tppush(tp, q);
+		pthread_cond_signal(&tp->cnd);
+	}
+	pthread_mutex_unlock(&tp->mtx);
+}
+
+size_t
+tpreserve(tpool *tp, size_t n)
+{
+	pthread_mutex_lock(&tp->mtx);
+	size_t idle = tp->tcnt - (tp->busy + tp->rsvd < tp->tcnt
+	                          ? tp->busy + tp->rsvd : tp->tcnt);
+	if (n > idle)
+		n = idle;
+	tp->rsvd += n;
+	pthread_mutex_unlock(&tp->mtx);
+	return n;
+}
+
+void
+tprelease(tpool *tp, size_t n)
+{
+	pthread_mutex_lock(&tp->mtx);
+	assert(n <= tp->rsvd);
+	tp->rsvd -= n;
+	pthread_cond_broadcast(&tp->cnd);
+	pthread_mutex_unlock(&tp->mtx);
+}
+
+/* Jobs that failed, keyed by the names given to tpfail().  A value of 1
+   means the job failed, and 0 that it has since succeeded. */
+static struct _cbs_map _cbs_tfmap;
+static char *_cbs_tfpath;
+static bool  _cbs_tfdirty;
+_CBS_MUTEX(_cbs_tfmtx);
+
+long long
+tprio(const char *key, char **ins, size_t n)
+{
+	long long prio = 0;
+
+	if (key != NULL) {
+		_cbs_lock(_cbs_tfmtx);
+		void **v = _cbs_mapget(&_cbs_tfmap, key, false);
+		bool failed = v != NULL && *v != NULL;
+		_cbs_unlock(_cbs_tfmtx);
+		if (failed)
+			return LLONG_MAX;
+	}
+
+	/* Nanoseconds since the epoch don’t overflow until 2262 */
+	for (size_t i = 0; i < n; i++) {
+		struct stat sb;
+		if (_cbs_stat(ins[i], &sb) == -1)
+			continue;
+		long long t = (long long)sb.st_mtim.tv_sec * 1000000000
+		            + sb.st_mtim.tv_nsec;
+		if (t > prio)
+			prio = t;
+	}
+	return prio;
+}
+
+void
+tpfail(const char *key, bool failed)
+{
+	_cbs_lock(_cbs_tfmtx);
+	void **v = _cbs_mapget(&_cbs_tfmap, key, failed);
+	if (v != NULL && (*v != NULL) != failed) {
+		*v = (void *)(intptr_t)failed;
+		_cbs_tfdirty = true;
+	}
+	_cbs_unlock(_cbs_tfmtx);
+}
+
+static void
+_cbs_tfwrite(FILE *fp)
+{
+	fputs("cbs-fail 1\n", fp);
+	for (size_t i = 0; i < _cbs_tfmap.cap; i++) {
+		if (_cbs_tfmap.buf[i].k != NULL && _cbs_tfmap.buf[i].v != NULL)
+			fprintf(fp, "%s\n", _cbs_tfmap.buf[i].k);
+	}
+}
+
+static void
+_cbs_tfsave(void)
+{
+	if (_cbs_tfdirty)
+		_cbs_fsave(_cbs_tfpath, _cbs_tfwrite);
+}
+
+void
+tpfailcache(const char *path)
+{
+	FILE *fp;
+	char buf[PATH_MAX + 1];
+
+	_cbs_lock(_cbs_tfmtx);
+	if (_cbs_tfpath == NULL)
+		atexit(_cbs_tfsave);
+	free(_cbs_tfpath);
+	assert((_cbs_tfpath = strdup(path)) != NULL);
+
+	if ((fp = _cbs_fload(path)) == NULL) {
+		_cbs_unlock(_cbs_tfmtx);
+		return;
+	}
+
+	if (fgets(buf, sizeof(buf), fp) != NULL && strcmp(buf, "cbs-fail 1\n") == 0) {
+		while (fgets(buf, sizeof(buf), fp) != NULL) {
+			buf[strcspn(buf, "\n")] = 0;
+			void **v = _cbs_mapget(&_cbs_tfmap, buf, true);
+			*v = (void *)1;
+		}
+	}
+	fclose(fp);
+	_cbs_unlock(_cbs_tfmtx);
+}
+
+bool
+tgwait(tpool *tp, tgroup *tg)
+{
+	pthread_mutex_lock(&tp->mtx);
+	while (!tp->stop && tg->left)
+		pthread_cond_wait(&tp->cnd, &tp->mtx);
 	pthread_mutex_unlock(&tp->mtx);
+	return !_tgfailed(tg);
+}
+
+void
+tgfail(tgroup *tg)
+{
+	_cbs_lock(_cbs_tgmtx);
+	tg->failed = true;
+	_cbs_unlock(_cbs_tgmtx);
+}
+
+struct _cbs_gen {
+	struct strs cmd;
+	tgroup *tg;
+};
+
+_CBS_MUTEX(_cbs_genmtx);
+static struct _cbs_map _cbs_genmap;
+
+static void
+_cbs_genjob(void *arg)
+{
+	struct _cbs_gen *g = arg;
+
+	cmdput(g->cmd);
+	if (cmdexec(g->cmd) != EXIT_SUCCESS)
+		tgfail(g->tg);
+}
+
+static void
+_cbs_genfree(void *arg)
+{
+	struct _cbs_gen *g = arg;
+	strsfree(&g->cmd);
+	free(g);
+}
+
+void
+tpgen(tpool *tp, tgroup *tg, struct strs cmd, char **outs, size_t n)
+{
+	struct _cbs_gen *g = calloc(1, sizeof(*g));
+	assert(g != NULL);
+	strspush(&g->cmd, cmd.buf, cmd.len);
+	g->tg = tg;
+
+	_cbs_lock(_cbs_genmtx);
+	for (size_t i = 0; i < n; i++)
+		*_cbs_mapget(&_cbs_genmap, outs[i], true) = tg;
+	_cbs_unlock(_cbs_genmtx);
+
+	tpenqx(tp, _cbs_genjob, g, _cbs_genfree, (struct tjobopts){.in = tg});
+}
+
+tgroup *
+fgen(const char *file)
+{
+	void **v;
+	tgroup *tg = NULL;
+
+	_cbs_lock(_cbs_genmtx);
+	if ((v = _cbs_mapget(&_cbs_genmap, file, false)) != NULL)
+		tg = *v;
+	_cbs_unlock(_cbs_genmtx);
+	return tg;
 }
 #endif /* !CBS_NO_THREADS */
 
+/* A directory listing, stored as a sequence of entries each made up of
+   the d_type byte followed by the null-terminated name */
+struct _cbs_dents {
+	char *buf;
+	size_t len, cap;
+};
+
+static void
+_cbs_dentpush(struct _cbs_dents *ds, unsigned char type, const char *name)
+{
+	size_t n = strlen(name) + 2;
+	if (ds->len + n > ds->cap) {
+		ds->cap = (ds->len + n) * 2;
+		ds->buf = realloc(ds->buf, ds->cap);
+		assert(ds->buf != NULL);
+	}
+	ds->buf[ds->len] = (char)type;
+	memcpy(ds->buf + ds->len + 1, name, n - 1);
+	ds->len += n;
+}
+
+static void
+_cbs_dentpush_at(struct _cbs_dents *ds, int fd, unsigned char type,
+                 const char *name)
+{
+	struct stat sb;
+
+#ifdef DT_UNKNOWN
+	if (type == DT_UNKNOWN)
+#endif
+	{
+		if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+			return;
+		type = S_ISDIR(sb.st_mode) ? DT_DIR : DT_REG;
+	}
+	_cbs_dentpush(ds, type, name);
+}
+
+/* Read all the entries of the directory open on fd, excluding ‘.’ and ‘..’.
+   On Linux getdents64(2) is used directly with a large buffer, as readdir(3)
+   reads in small chunks */
+static void
+_cbs_dread(int fd, struct _cbs_dents *ds)
+{
+#if defined(__linux__) && defined(SYS_getdents64)
+	struct _cbs_dirent64 {
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+	};
+	static const size_t bufsz = 64 * 1024;
+	char *buf = malloc(bufsz);
+	assert(buf != NULL);
+
+	for (;;) {
+		long nr = syscall(SYS_getdents64, fd, buf, bufsz);
+		assert(nr != -1);
+		if (nr == 0)
+			break;
+		for (long off = 0; off < nr;) {
+			struct _cbs_dirent64 *d = (void *)(buf + off);
+			off += d->d_reclen;
+			if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+				_cbs_dentpush_at(ds, fd, d->d_type, d->d_name);
+		}
+	}
+
+	free(buf);
+#else
+	int dfd = dup(fd);
+	assert(dfd != -1);
+	DIR *dp = fdopendir(dfd);
+	assert(dp != NULL);
+
+	struct dirent *d;
+	while ((d = readdir(dp)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+#	ifdef DT_UNKNOWN
+		_cbs_dentpush_at(ds, fd, d->d_type, d->d_name);
+#	else
+		_cbs_dentpush_at(ds, fd, 0, d->d_name);
+#	endif
+	}
+	closedir(dp);
+#endif
+}
+
+struct _cbs_dgent {
+	struct timespec mtim;
+	struct _cbs_dents ds;
+	bool seen;
+};
+
+_CBS_MUTEX(_cbs_dgmtx);
+static char *_cbs_dgpath;
+static bool _cbs_dgdirty;
+static struct _cbs_map _cbs_dgmap;
+
+static void
+_cbs_dgwrite(FILE *fp)
+{
+	fputs("cbs-dglob 1\n", fp);
+	for (size_t i = 0; i < _cbs_dgmap.cap; i++) {
+		struct _cbs_dgent *e = _cbs_dgmap.buf[i].v;
+		if (_cbs_dgmap.buf[i].k == NULL || !e->seen)
+			continue;
+		fprintf(fp, "%lld %ld %zu %s\n", (long long)e->mtim.tv_sec,
+		        (long)e->mtim.tv_nsec, e->ds.len, _cbs_dgmap.buf[i].k);
+		fwrite(e->ds.buf, 1, e->ds.len, fp);
+	}
+}
+
+static void
+_cbs_dgsave(void)
+{
+	if (_cbs_dgdirty)
+		_cbs_fsave(_cbs_dgpath, _cbs_dgwrite);
+}
+
+void
+dgcache(const char *path)
+{
+	FILE *fp;
+	char buf[PATH_MAX + 64];
+
+	_cbs_lock(_cbs_dgmtx);
+	if (_cbs_dgpath == NULL)
+		atexit(_cbs_dgsave);
+	free(_cbs_dgpath);
+	assert((_cbs_dgpath = strdup(path)) != NULL);
+
+	if ((fp = _cbs_fload(path)) == NULL) {
+		_cbs_unlock(_cbs_dgmtx);
+		return;
+	}
+
+	/* A corrupt or foreign cache is ignored from the point it goes wrong;
+	   the affected directories will simply be read again */
+	if (fgets(buf, sizeof(buf), fp) == NULL || strcmp(buf, "cbs-dglob 1\n") != 0)
+		goto out;
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		long long sec;
+		long nsec;
+		size_t len;
+		int off;
+
+		buf[strcspn(buf, "\n")] = 0;
+		if (sscanf(buf, "%lld %ld %zu %n", &sec, &nsec, &len, &off) != 3)
+			break;
+
+		struct _cbs_dgent *e = calloc(1, sizeof(*e));
+		assert(e != NULL);
+		e->mtim.tv_sec = sec;
+		e->mtim.tv_nsec = nsec;
+		e->ds.len = e->ds.cap = len;
+		assert((e->ds.buf = malloc(len + 1)) != NULL);
+		if (fread(e->ds.buf, 1, len, fp) != len) {
+			free(e->ds.buf);
+			free(e);
+			break;
+		}
+
+		void **v = _cbs_mapget(&_cbs_dgmap, buf + off, true);
+		if (*v != NULL) {
+			free(((struct _cbs_dgent *)*v)->ds.buf);
+			free(*v);
+		}
+		*v = e;
+	}
+out:
+	fclose(fp);
+	_cbs_unlock(_cbs_dgmtx);
+}
+
+/* Open the directory name relative to dfd, exiting if it can’t be opened
+   so that a glob never silently misses part of the tree.  Path is the
+   directory’s path for error messages. */
+static int
+_cbs_dgopen(int dfd, const char *name, const char *path)
+{
+	int fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "%s: open: %s: %s\n", *_cbs_argv, path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/* List the directory at path into ds.  If the listing cache is enabled
+   and the directory’s modification time matches that of the cached
+   listing, the cached listing is used and -1 is returned.  Otherwise the
+   directory is read from fd — or opened when fd is -1 — and the open
+   descriptor is returned. */
+static int
+_cbs_dlist(int fd, const char *path, struct _cbs_dents *ds)
+{
+	struct stat sb;
+	struct _cbs_dgent *e = NULL;
+
+	if (_cbs_dgpath == NULL) {
+		if (fd == -1)
+			fd = _cbs_dgopen(_cbs_dirfd, path, path);
+		_cbs_dread(fd, ds);
+		return fd;
+	}
+
+	if ((fd != -1 ? fstat(fd, &sb) : fstatat(_cbs_dirfd, path, &sb, 0)) == -1) {
+		fprintf(stderr, "%s: stat: %s: %s\n", *_cbs_argv, path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	_cbs_lock(_cbs_dgmtx);
+	void **v = _cbs_mapget(&_cbs_dgmap, path, false);
+	if (v != NULL && (e = *v) != NULL
+	 && e->mtim.tv_sec == sb.st_mtim.tv_sec
+	 && e->mtim.tv_nsec == sb.st_mtim.tv_nsec)
+	{
+		e->seen = true;
+		ds->len = ds->cap = e->ds.len;
+		assert((ds->buf = malloc(ds->len + 1)) != NULL);
+		memcpy(ds->buf, e->ds.buf, ds->len);
+		_cbs_unlock(_cbs_dgmtx);
+		return -1;
+	}
+	_cbs_unlock(_cbs_dgmtx);
+
+	if (fd == -1)
+		fd = _cbs_dgopen(_cbs_dirfd, path, path);
+	_cbs_dread(fd, ds);
+
+	/* A directory modified within the last second may be modified again
+	   without its timestamp changing, so don’t trust it next time */
+	if (sb.st_mtim.tv_sec >= time(NULL) - 1)
+		return fd;
+
+	_cbs_lock(_cbs_dgmtx);
+	v = _cbs_mapget(&_cbs_dgmap, path, true);
+	if ((e = *v) == NULL)
+		assert((e = *v = calloc(1, sizeof(*e))) != NULL);
+	e->mtim = sb.st_mtim;
+	e->seen = true;
+	e->ds.len = e->ds.cap = ds->len;
+	assert((e->ds.buf = realloc(e->ds.buf, ds->len + 1)) != NULL);
+	memcpy(e->ds.buf, ds->buf, ds->len);
+	_cbs_dgdirty = true;
+	_cbs_unlock(_cbs_dgmtx);
+	return fd;
+}
+
+struct _cbs_dglob {
+	struct strs *xs;
+	char **pats;
+	size_t npats;
+	int flags;
+#ifndef CBS_NO_THREADS
+	tpool *tp;
+	size_t left;
+	pthread_mutex_t mtx;
+	pthread_cond_t cnd;
+#endif
+};
+
+/* Queued directories are only opened once their job runs, so that a wide
+   tree doesn’t hold a descriptor open for every pending directory */
+struct _cbs_dgjob {
+	struct _cbs_dglob *g;
+	char *path;
+};
+
+static void _cbs_dgwalk(struct _cbs_dglob *, int, const char *);
+
+#ifndef CBS_NO_THREADS
+static void
+_cbs_dgjob(void *arg)
+{
+	struct _cbs_dgjob *j = arg;
+	struct _cbs_dglob *g = j->g;
+
+	_cbs_dgwalk(g, -1, j->path);
+	free(j->path);
+	free(j);
+
+	pthread_mutex_lock(&g->mtx);
+	if (--g->left == 0)
+		pthread_cond_signal(&g->cnd);
+	pthread_mutex_unlock(&g->mtx);
+}
+#endif
+
+static char *
+_cbs_pathjoin(const char *dir, const char *name)
+{
+	char *p;
+	if (strcmp(dir, ".") == 0)
+		p = strdup(name);
+	else {
+		size_t n = strlen(dir);
+		p = malloc(n + strlen(name) + 2);
+		if (p != NULL)
+			sprintf(p, "%s%s%s", dir, dir[n - 1] == '/' ? "" : "/", name);
+	}
+	assert(p != NULL);
+	return p;
+}
+
+/* Walk the directory at path, which is open on fd or not yet opened if fd
+   is -1.  When the listing cache is enabled directories are only opened
+   when their cached listing is out of date. */
+static void
+_cbs_dgwalk(struct _cbs_dglob *g, int fd, const char *path)
+{
+	struct _cbs_dents ds = {0};
+	struct strs found = {0};
+	int dfd = _cbs_dlist(fd, path, &ds);
+
+	for (size_t i = 0; i < ds.len; i += strlen(ds.buf + i + 1) + 2) {
+		unsigned char type = ds.buf[i];
+		const char *name = ds.buf + i + 1;
+
+		if (name[0] == '.' && !(g->flags & DG_HIDDEN))
+			continue;
+
+		if (type == DT_DIR) {
+			if (!(g->flags & DG_RECURSE))
+				continue;
+			char *sub = _cbs_pathjoin(path, name);
+#ifndef CBS_NO_THREADS
+			if (g->tp != NULL) {
+				struct _cbs_dgjob *j = malloc(sizeof(*j));
+				assert(j != NULL);
+				*j = (struct _cbs_dgjob){.g = g, .path = sub};
+				pthread_mutex_lock(&g->mtx);
+				g->left++;
+				pthread_mutex_unlock(&g->mtx);
+				tpenq(g->tp, _cbs_dgjob, j, NULL);
+				continue;
+			}
+#endif
+			int sfd = dfd != -1 ? _cbs_dgopen(dfd, name, sub) : -1;
+			_cbs_dgwalk(g, sfd, sub);
+			if (sfd != -1)
+				close(sfd);
+			free(sub);
+			continue;
+		}
+
+		for (size_t j = 0; j < g->npats; j++) {
+			if (fnmatch(g->pats[j], name, 0) == 0) {
+				strspushl(&found, _cbs_pathjoin(path, name));
+				break;
+			}
+		}
+	}
+
+#ifndef CBS_NO_THREADS
+	if (g->tp != NULL)
+		pthread_mutex_lock(&g->mtx);
+#endif
+	strspush(g->xs, found.buf, found.len);
+#ifndef CBS_NO_THREADS
+	if (g->tp != NULL)
+		pthread_mutex_unlock(&g->mtx);
+#endif
+
+	if (dfd != fd && dfd != -1)
+		close(dfd);
+	strsfree(&found);
+	free(ds.buf);
+}
+
+static int
+_cbs_strcmp(const void *x, const void *y)
+{
+	return strcmp(*(char **)x, *(char **)y);
+}
+
+static void
+_cbs_dglob(struct _cbs_dglob *g, const char *dir)
+{
+	size_t off = g->xs->len;
+
+#ifndef CBS_NO_THREADS
+	if (g->tp != NULL) {
+		struct _cbs_dgjob *j = malloc(sizeof(*j));
+		assert(j != NULL);
+		*j = (struct _cbs_dgjob){.g = g};
+		assert((j->path = strdup(dir)) != NULL);
+
+		pthread_mutex_init(&g->mtx, NULL);
+		pthread_cond_init(&g->cnd, NULL);
+		g->left = 1;
+		tpenq(g->tp, _cbs_dgjob, j, NULL);
+
+		pthread_mutex_lock(&g->mtx);
+		while (g->left > 0)
+			pthread_cond_wait(&g->cnd, &g->mtx);
+		pthread_mutex_unlock(&g->mtx);
+		pthread_cond_destroy(&g->cnd);
+		pthread_mutex_destroy(&g->mtx);
+	} else
+#endif
+		_cbs_dgwalk(g, -1, dir);
+
+	/* Sort the results so that the output does not depend on the order of
+	   directory entries or on thread scheduling */
+	qsort(g->xs->buf + off, g->xs->len - off, sizeof(char *), _cbs_strcmp);
+}
+
+void
+dglob(struct strs *xs, const char *dir, int flags, char **pats, size_t n)
+{
+	struct _cbs_dglob g = {
+		.xs    = xs,
+		.pats  = pats,
+		.npats = n,
+		.flags = flags,
+	};
+	_cbs_dglob(&g, dir);
+}
+
+#ifndef CBS_NO_THREADS
+void
+dglob_tp(tpool *tp, struct strs *xs, const char *dir, int flags, char **pats,
+         size_t n)
+{
+	struct _cbs_dglob g = {
+		.xs    = xs,
+		.pats  = pats,
+		.npats = n,
+		.flags = flags,
+		.tp    = tp,
+	};
+	_cbs_dglob(&g, dir);
+}
+#endif
+
+/* The hash used by fhash() is a 128-bit variant of the XXH3 construction.
+   The stripe loop works on eight independent 64-bit lanes so that compilers
+   vectorize it with whatever SIMD instructions the target supports.  Input
+   is always read as little-endian so that hashes are portable between
+   machines. */
+#define _CBS_P32_1 UINT64_C(0x9E3779B1)
+#define _CBS_P32_2 UINT64_C(0x85EBCA77)
+#define _CBS_P32_3 UINT64_C(0xC2B2AE3D)
+#define _CBS_P64_1 UINT64_C(0x9E3779B185EBCA87)
+#define _CBS_P64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define _CBS_P64_3 UINT64_C(0x165667B19E3779F9)
+#define _CBS_P64_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define _CBS_P64_5 UINT64_C(0x27D4EB2F165667C5)
+
+static const uint64_t _cbs_hkey[16] = {
+	UINT64_C(0xBE4BA423396CFEB8), UINT64_C(0x1CAD21F72C81017C),
+	UINT64_C(0xDB979083E96DD4DE), UINT64_C(0x1F67B3B7A4A44072),
+	UINT64_C(0x78E5C0CC4EE679CB), UINT64_C(0x2172FFCC7DD05A82),
+	UINT64_C(0x8E2443F7744608B8), UINT64_C(0x4C263A81E69035E0),
+	UINT64_C(0xCB00C391BB52283C), UINT64_C(0xA32E531B8B65D088),
+	UINT64_C(0x4EF90DA297486471), UINT64_C(0xD8ACDEA946EF1938),
+	UINT64_C(0x3F349CE33F76FAA8), UINT64_C(0x1D4F0BC7C7BBDCF9),
+	UINT64_C(0x3159B4CD4BE0518A), UINT64_C(0x647378D9C97E9FC8),
+};
+
+struct _cbs_hstate {
+	uint64_t acc[8], len, nstripes;
+	unsigned char buf[64];
+	size_t nbuf;
+};
+
+static uint64_t
+_cbs_rd64(const unsigned char *p)
+{
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+static uint64_t
+_cbs_mulfold(uint64_t x, uint64_t y)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)x * y;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	uint64_t xl = x & 0xFFFFFFFF, xh = x >> 32;
+	uint64_t yl = y & 0xFFFFFFFF, yh = y >> 32;
+	uint64_t ll = xl * yl, lh = xl * yh, hl = xh * yl, hh = xh * yh;
+	uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFF) + hl;
+	uint64_t lo = (mid << 32) | (ll & 0xFFFFFFFF);
+	uint64_t hi = hh + (lh >> 32) + (mid >> 32);
+	return lo ^ hi;
+#endif
+}
+
+static uint64_t
+_cbs_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= _CBS_P64_3;
+	return h ^ (h >> 32);
+}
+
+static void
+_cbs_hinit(struct _cbs_hstate *h)
+{
+	static const uint64_t init[8] = {
+		_CBS_P32_3, _CBS_P64_1, _CBS_P64_2, _CBS_P64_3,
+		_CBS_P64_4, _CBS_P32_2, _CBS_P64_5, _CBS_P32_1,
+	};
+	memcpy(h->acc, init, sizeof(init));
+	h->len = h->nstripes = h->nbuf = 0;
+}
+
+static void
+_cbs_hstripe(struct _cbs_hstate *h, const unsigned char *p)
+{
+	const uint64_t *key = _cbs_hkey + (h->nstripes & 7);
+
+	for (int i = 0; i < 8; i++) {
+		uint64_t d = _cbs_rd64(p + i * 8);
+		uint64_t v = d ^ key[i];
+		h->acc[i ^ 1] += d;
+		h->acc[i] += (v & 0xFFFFFFFF) * (v >> 32);
+	}
+
+	if ((++h->nstripes & 15) == 0) {
+		for (int i = 0; i < 8; i++) {
+			h->acc[i] ^= h->acc[i] >> 47;
+			h->acc[i] ^= _cbs_hkey[8 + i];
+			h->acc[i] *= _CBS_P32_1;
+		}
+	}
+}
+
+static void
+_cbs_hupdate(struct _cbs_hstate *h, const void *buf, size_t n)
+{
+	const unsigned char *p = buf;
+
+	h->len += n;
+	if (h->nbuf > 0) {
+		size_t m = sizeof(h->buf) - h->nbuf;
+		if (m > n)
+			m = n;
+		memcpy(h->buf + h->nbuf, p, m);
+		h->nbuf += m;
+		p += m, n -= m;
+		if (h->nbuf < sizeof(h->buf))
+			return;
+		_cbs_hstripe(h, h->buf);
+		h->nbuf = 0;
+	}
+
+	for (; n >= 64; p += 64, n -= 64)
+		_cbs_hstripe(h, p);
+
+	memcpy(h->buf, p, n);
+	h->nbuf = n;
+}
+
+static struct hash128
+_cbs_hfinal(struct _cbs_hstate *h)
+{
+	struct hash128 r;
+
+	memset(h->buf + h->nbuf, 0, sizeof(h->buf) - h->nbuf);
+	_cbs_hstripe(h, h->buf);
+
+	r.lo = h->len * _CBS_P64_1;
+	r.hi = ~h->len * _CBS_P64_2;
+	for (int i = 0; i < 4; i++) {
+		r.lo += _cbs_mulfold(h->acc[2 * i] ^ _cbs_hkey[2 * i],
+		                     h->acc[2 * i + 1] ^ _cbs_hkey[2 * i + 1]);
+		r.hi += _cbs_mulfold(h->acc[2 * i] ^ _cbs_hkey[8 + 2 * i],
+		                     h->acc[2 * i + 1] ^ _cbs_hkey[9 + 2 * i]);
+	}
+	r.lo = _cbs_avalanche(r.lo);
+	r.hi = _cbs_avalanche(r.hi);
+	return r;
+}
+
+struct hash128
+memhash(const void *p, size_t n)
+{
+	struct _cbs_hstate h;
+	_cbs_hinit(&h);
+	_cbs_hupdate(&h, p, n);
+	return _cbs_hfinal(&h);
+}
+
+/* Format the hash x as 32 lowercase hexadecimal digits */
+static void
+_cbs_hhex(struct hash128 x, char buf[33])
+{
+	sprintf(buf, "%016llx%016llx", (unsigned long long)x.hi,
+	        (unsigned long long)x.lo);
+}
+
+static bool
+_cbs_hunhex(const char *s, struct hash128 *x)
+{
+	unsigned long long hi, lo;
+	if (sscanf(s, "%16llx%16llx", &hi, &lo) != 2)
+		return false;
+	x->hi = hi;
+	x->lo = lo;
+	return true;
+}
+
+struct _cbs_fhent {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtim;
+	struct hash128 h;
+};
+
+_CBS_MUTEX(_cbs_fhmtx);
+static char *_cbs_fhpath;
+static bool _cbs_fhdirty;
+static struct _cbs_map _cbs_fhmap;
+
+static bool
+_cbs_fhmatch(const struct _cbs_fhent *e, const struct stat *sb)
+{
+	return e->dev == sb->st_dev && e->ino == sb->st_ino
+	    && e->size == sb->st_size
+	    && e->mtim.tv_sec == sb->st_mtim.tv_sec
+	    && e->mtim.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+static void
+_cbs_fhwrite(FILE *fp)
+{
+	char hex[33];
+	time_t now = time(NULL);
+
+	for (size_t i = 0; i < _cbs_fhmap.cap; i++) {
+		struct _cbs_fhent *e = _cbs_fhmap.buf[i].v;
+		if (_cbs_fhmap.buf[i].k == NULL)
+			continue;
+
+		/* A file modified within the last second may be modified again
+		   without its timestamp changing, so don’t trust it next time */
+		if (e->mtim.tv_sec >= now - 1)
+			continue;
+
+		_cbs_hhex(e->h, hex);
+		fprintf(fp, "%s %llu %llu %lld %lld %ld %s\n", hex,
+		        (unsigned long long)e->dev, (unsigned long long)e->ino,
+		        (long long)e->size, (long long)e->mtim.tv_sec,
+		        (long)e->mtim.tv_nsec, _cbs_fhmap.buf[i].k);
+	}
+}
+
+static void
+_cbs_fhsave(void)
+{
+	if (_cbs_fhdirty)
+		_cbs_fsave(_cbs_fhpath, _cbs_fhwrite);
+}
+
+void
+fhcache(const char *path)
+{
+	FILE *fp;
+	char buf[PATH_MAX + 128];
+
+	_cbs_lock(_cbs_fhmtx);
+	if (_cbs_fhpath == NULL)
+		atexit(_cbs_fhsave);
+	free(_cbs_fhpath);
+	assert((_cbs_fhpath = strdup(path)) != NULL);
+
+	if ((fp = _cbs_fload(path)) == NULL) {
+		_cbs_unlock(_cbs_fhmtx);
+		return;
+	}
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		unsigned long long dev, ino;
+		long long size, sec;
+		long nsec;
+		int off;
+		struct _cbs_fhent e;
+
+		buf[strcspn(buf, "\n")] = 0;
+		if (!_cbs_hunhex(buf, &e.h)
+		 || sscanf(buf + 32, " %llu %llu %lld %lld %ld %n", &dev, &ino, &size,
+		           &sec, &nsec, &off) != 5)
+		{
+			break;
+		}
+		e.dev = dev;
+		e.ino = ino;
+		e.size = size;
+		e.mtim.tv_sec = sec;
+		e.mtim.tv_nsec = nsec;
+
+		void **v = _cbs_mapget(&_cbs_fhmap, buf + 32 + off, true);
+		if (*v == NULL)
+			assert((*v = malloc(sizeof(e))) != NULL);
+		memcpy(*v, &e, sizeof(e));
+	}
+
+	fclose(fp);
+	_cbs_unlock(_cbs_fhmtx);
+}
+
+bool
+fhash(const char *f, struct hash128 *h)
+{
+	int fd;
+	void **v;
+	struct stat sb;
+	struct _cbs_hstate st;
+
+	if ((fd = _cbs_open(f, O_RDONLY)) == -1)
+		return false;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return false;
+	}
+
+	_cbs_lock(_cbs_fhmtx);
+	if ((v = _cbs_mapget(&_cbs_fhmap, f, false)) != NULL
+	 && _cbs_fhmatch(*v, &sb))
+	{
+		*h = ((struct _cbs_fhent *)*v)->h;
+		_cbs_unlock(_cbs_fhmtx);
+		close(fd);
+		return true;
+	}
+	_cbs_unlock(_cbs_fhmtx);
+
+	_cbs_hinit(&st);
+
+	/* Large files are mapped into memory, smaller ones are read in a single
+	   system call where possible */
+	void *p = MAP_FAILED;
+	if (sb.st_size >= 256 * 1024) {
+		p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+#ifdef POSIX_MADV_SEQUENTIAL
+			posix_madvise(p, sb.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+			_cbs_hupdate(&st, p, sb.st_size);
+			munmap(p, sb.st_size);
+		}
+	}
+	if (p == MAP_FAILED) {
+		static const size_t bufsz = 256 * 1024;
+		void *buf;
+		ssize_t nr;
+
+		assert(posix_memalign(&buf, 4096, bufsz) == 0);
+		while ((nr = read(fd, buf, bufsz)) > 0)
+			_cbs_hupdate(&st, buf, nr);
+		free(buf);
+		if (nr == -1) {
+			close(fd);
+			return false;
+		}
+	}
+
+	close(fd);
+	*h = _cbs_hfinal(&st);
+
+	_cbs_lock(_cbs_fhmtx);
+	v = _cbs_mapget(&_cbs_fhmap, f, true);
+	if (*v == NULL)
+		assert((*v = malloc(sizeof(struct _cbs_fhent))) != NULL);
+	*(struct _cbs_fhent *)*v = (struct _cbs_fhent){
+		.dev  = sb.st_dev,
+		.ino  = sb.st_ino,
+		.size = sb.st_size,
+		.mtim = sb.st_mtim,
+		.h    = *h,
+	};
+	_cbs_fhdirty = true;
+	_cbs_unlock(_cbs_fhmtx);
+	return true;
+}
+
+bool
+elfinit(struct elf *e, const void *buf, size_t n)
+{
+	const unsigned char *p = buf;
+
+	*e = (struct elf){.buf = p, .len = n};
+	if (n < EI_NIDENT || memcmp(p, ELFMAG, SELFMAG) != 0)
+		return false;
+
+	/* Only the native byte order is supported */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	if (p[EI_DATA] != ELFDATA2MSB)
+		return false;
+#else
+	if (p[EI_DATA] != ELFDATA2LSB)
+		return false;
+#endif
+
+	if (p[EI_CLASS] == ELFCLASS64 && n >= sizeof(Elf64_Ehdr)) {
+		const Elf64_Ehdr *eh = buf;
+		e->is64 = true;
+		e->shoff = eh->e_shoff;
+		e->shnum = eh->e_shnum;
+		e->shentsize = eh->e_shentsize;
+		e->shstrndx = eh->e_shstrndx;
+	} else if (p[EI_CLASS] == ELFCLASS32 && n >= sizeof(Elf32_Ehdr)) {
+		const Elf32_Ehdr *eh = buf;
+		e->shoff = eh->e_shoff;
+		e->shnum = eh->e_shnum;
+		e->shentsize = eh->e_shentsize;
+		e->shstrndx = eh->e_shstrndx;
+	} else
+		return false;
+
+	if (e->shoff == 0) {
+		e->shnum = 0;
+		return true;
+	}
+	if (e->shentsize < (e->is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr))
+	 || e->shoff > n || (n - e->shoff) / e->shentsize < 1)
+	{
+		return false;
+	}
+
+	/* Files with very many sections store the real counts in the first
+	   section header */
+	const unsigned char *sh0 = p + e->shoff;
+	if (e->shnum == 0) {
+		e->shnum = e->is64 ? ((const Elf64_Shdr *)sh0)->sh_size
+		                   : ((const Elf32_Shdr *)sh0)->sh_size;
+	}
+	if (e->shstrndx == SHN_XINDEX) {
+		e->shstrndx = e->is64 ? ((const Elf64_Shdr *)sh0)->sh_link
+		                      : ((const Elf32_Shdr *)sh0)->sh_link;
+	}
+	return e->shnum <= (n - e->shoff) / e->shentsize;
+}
+
+bool
+elfopen(struct elf *e, const char *f)
+{
+	int fd;
+	struct stat sb;
+	void *p;
+
+	*e = (struct elf){0};
+	if ((fd = _cbs_open(f, O_RDONLY)) == -1)
+		return false;
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	if (!elfinit(e, p, sb.st_size)) {
+		munmap(p, sb.st_size);
+		*e = (struct elf){0};
+		return false;
+	}
+	e->mapped = true;
+	return true;
+}
+
+void
+elfclose(struct elf *e)
+{
+	if (e->mapped)
+		munmap((void *)e->buf, e->len);
+	*e = (struct elf){0};
+}
+
+size_t
+elfnsec(const struct elf *e)
+{
+	return e->shnum;
+}
+
+bool
+elfsec(const struct elf *e, size_t i, struct elfsec *s)
+{
+	uint64_t off, nameoff;
+
+	if (i >= e->shnum)
+		return false;
+
+	const unsigned char *sh = e->buf + e->shoff + i * e->shentsize;
+	if (e->is64) {
+		const Elf64_Shdr *h = (const void *)sh;
+		*s = (struct elfsec){
+			.type    = h->sh_type,
+			.link    = h->sh_link,
+			.info    = h->sh_info,
+			.flags   = h->sh_flags,
+			.addr    = h->sh_addr,
+			.size    = h->sh_size,
+			.entsize = h->sh_entsize,
+		};
+		off = h->sh_offset;
+		nameoff = h->sh_name;
+	} else {
+		const Elf32_Shdr *h = (const void *)sh;
+		*s = (struct elfsec){
+			.type    = h->sh_type,
+			.link    = h->sh_link,
+			.info    = h->sh_info,
+			.flags   = h->sh_flags,
+			.addr    = h->sh_addr,
+			.size    = h->sh_size,
+			.entsize = h->sh_entsize,
+		};
+		off = h->sh_offset;
+		nameoff = h->sh_name;
+	}
+
+	if (s->type != SHT_NOBITS) {
+		if (off > e->len || s->size > e->len - off)
+			return false;
+		s->data = e->buf + off;
+	}
+
+	/* Section names are looked up in the section header string table */
+	s->name = "";
+	if (e->shstrndx != SHN_UNDEF && e->shstrndx != i) {
+		struct elfsec strs;
+		if (elfsec(e, e->shstrndx, &strs) && strs.data != NULL
+		 && nameoff < strs.size
+		 && memchr((const char *)strs.data + nameoff, 0,
+		           strs.size - nameoff) != NULL)
+		{
+			s->name = (const char *)strs.data + nameoff;
+		}
+	}
+	return true;
+}
+
+size_t
+elfnsym(const struct elf *e, const struct elfsec *s)
+{
+	size_t ent = e->is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+	if ((s->type != SHT_SYMTAB && s->type != SHT_DYNSYM) || s->data == NULL
+	 || s->entsize < ent)
+	{
+		return 0;
+	}
+	return s->size / s->entsize;
+}
+
+bool
+elfsym(const struct elf *e, const struct elfsec *s, size_t i,
+       struct elfsym *sym)
+{
+	uint64_t name;
+	struct elfsec strs;
+
+	if (i >= elfnsym(e, s))
+		return false;
+
+	const unsigned char *q = (const unsigned char *)s->data + i * s->entsize;
+	if (e->is64) {
+		const Elf64_Sym *st = (const void *)q;
+		name = st->st_name;
+		sym->bind = ELF64_ST_BIND(st->st_info);
+		sym->type = ELF64_ST_TYPE(st->st_info);
+		sym->vis = ELF64_ST_VISIBILITY(st->st_other);
+		sym->shndx = st->st_shndx;
+		sym->value = st->st_value;
+		sym->size = st->st_size;
+	} else {
+		const Elf32_Sym *st = (const void *)q;
+		name = st->st_name;
+		sym->bind = ELF32_ST_BIND(st->st_info);
+		sym->type = ELF32_ST_TYPE(st->st_info);
+		sym->vis = ELF32_ST_VISIBILITY(st->st_other);
+		sym->shndx = st->st_shndx;
+		sym->value = st->st_value;
+		sym->size = st->st_size;
+	}
+
+	/* Symbol names are looked up in the string table linked to by the
+	   symbol table */
+	if (!elfsec(e, s->link, &strs) || strs.data == NULL || name >= strs.size
+	 || memchr((const char *)strs.data + name, 0, strs.size - name) == NULL)
+	{
+		return false;
+	}
+	sym->name = (const char *)strs.data + name;
+	return true;
+}
+
+bool
+soabi(const char *lib, const char *stamp)
+{
+	int fd;
+	struct elf e;
+	struct hash128 h;
+	struct strs syms = {0};
+	bool ok;
+	char hex[33], old[33] = {0};
+
+	if ((ok = elfopen(&e, lib))) {
+		for (size_t i = 0; i < elfnsec(&e); i++) {
+			struct elfsec sec;
+			if (!elfsec(&e, i, &sec)) {
+				ok = false;
+				break;
+			}
+			if (sec.type != SHT_DYNSYM)
+				continue;
+
+			/* Entry 0 is always the undefined symbol */
+			for (size_t j = 1; j < elfnsym(&e, &sec); j++) {
+				struct elfsym sym;
+				if (!elfsym(&e, &sec, j, &sym)) {
+					ok = false;
+					break;
+				}
+				if (sym.shndx == SHN_UNDEF || sym.bind == STB_LOCAL
+				 || (sym.vis != STV_DEFAULT && sym.vis != STV_PROTECTED))
+				{
+					continue;
+				}
+
+				/* The size of data symbols is part of the interface because
+				   of copy relocations, the size of functions is not */
+				bool data = sym.type == STT_OBJECT || sym.type == STT_TLS;
+				char *s = malloc(strlen(sym.name) + 64);
+				assert(s != NULL);
+				sprintf(s, "%s %d %d %d %llu", sym.name, sym.type, sym.bind,
+				        sym.vis, data ? (unsigned long long)sym.size : 0ULL);
+				strspushl(&syms, s);
+			}
+		}
+		elfclose(&e);
+	}
+
+	if (ok) {
+		/* Sort so that the hash doesn’t depend on the link order */
+		struct _cbs_hstate st;
+		qsort(syms.buf, syms.len, sizeof(char *), _cbs_strcmp);
+		_cbs_hinit(&st);
+		for (size_t i = 0; i < syms.len; i++) {
+			_cbs_hupdate(&st, syms.buf[i], strlen(syms.buf[i]) + 1);
+			free(syms.buf[i]);
+		}
+		h = _cbs_hfinal(&st);
+	} else {
+		for (size_t i = 0; i < syms.len; i++)
+			free(syms.buf[i]);
+		assert(fhash(lib, &h));
+	}
+	strsfree(&syms);
+
+	/* Only touch the stamp if the interface changed, so that dependents
+	   depending on the stamp aren’t relinked otherwise */
+	_cbs_hhex(h, hex);
+	if ((fd = _cbs_open(stamp, O_RDONLY)) != -1) {
+		ssize_t nr = read(fd, old, 32);
+		close(fd);
+		if (nr == 32 && strcmp(old, hex) == 0)
+			return false;
+	}
+
+	/* The interface may have changed even if the stamp can’t be written */
+	hex[32] = '\n';
+	if (!_cbs_writeall(stamp, hex, 33))
+		fprintf(stderr, "%s: write: %s: %s\n", *_cbs_argv, stamp, strerror(errno));
+	return true;
+}
+
+static char *_cbs_ccdir, *_cbs_ccbase;
+
+/* Return a copy of the absolute path of the directory relative paths are
+   resolved against */
+static char *
+_cbs_scriptdir(void)
+{
+	char *p = _cbs_dirpath != NULL ? strdup(_cbs_dirpath) : realpath(".", NULL);
+	assert(p != NULL);
+	return p;
+}
+
+void
+cachedir(const char *dir)
+{
+	free(_cbs_ccdir);
+	_cbs_ccdir = NULL;
+	if (dir != NULL) {
+		assert(mkdirp(dir));
+		assert((_cbs_ccdir = strdup(dir)) != NULL);
+		if (_cbs_ccbase == NULL)
+			_cbs_ccbase = _cbs_scriptdir();
+	}
+}
+
+void
+ccbase(const char *dir)
+{
+	char *p = NULL;
+
+	free(_cbs_ccbase);
+	if (dir == NULL)
+		_cbs_ccbase = _cbs_scriptdir();
+	else if (*dir == '/')
+		_cbs_ccbase = realpath(dir, NULL);
+	else {
+		p = _cbs_scriptdir();
+		char *q = _cbs_pathjoin(p, dir);
+		_cbs_ccbase = realpath(q, NULL);
+		free(q);
+	}
+	free(p);
+
+	if (_cbs_ccbase == NULL) {
+		fprintf(stderr, "%s: realpath: %s: %s\n", *_cbs_argv, dir,
+		        strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Return a copy of the n bytes at s with every occurrence of the path
+   from replaced by to */
+static char *
+_cbs_ccsubst(const char *s, size_t n, const char *from, const char *to,
+             size_t *outsz)
+{
+	char *buf;
+	size_t len, fl = strlen(from);
+	const char *p, *end = s + n;
+	FILE *fp = open_memstream(&buf, &len);
+
+	assert(fp != NULL);
+	while (fl > 0 && (p = memmem(s, end - s, from, fl)) != NULL) {
+		fwrite(s, 1, p - s, fp);
+		/* Only replace whole path components, so /src doesn’t match the
+		   start of /srcs */
+		if (p + fl == end || strchr("/ \t\n\\:=", p[fl]) != NULL)
+			fputs(to, fp);
+		else
+			fwrite(p, 1, fl, fp);
+		s = p + fl;
+	}
+	fwrite(s, 1, end - s, fp);
+	assert(fclose(fp) != EOF);
+	if (outsz != NULL)
+		*outsz = len;
+	return buf;
+}
+
+/* Paths in manifests and cached dependency files have the base directory
+   replaced by a placeholder byte, so that they can be mapped back to
+   whichever checkout the entry is restored into */
+#define _CBS_CCBASE "\1"
+
+/* Replace the base directory in the n bytes at s by to.  A base of ‘/’ is
+   left alone, as it can’t be told apart from the separators of every other
+   path. */
+static char *
+_cbs_ccrebase(const char *s, size_t n, const char *to, size_t *outsz)
+{
+	const char *from = strcmp(_cbs_ccbase, "/") == 0 ? "" : _cbs_ccbase;
+	return _cbs_ccsubst(s, n, from, to, outsz);
+}
+
+static char *
+_cbs_ccnorm(const char *s)
+{
+	return _cbs_ccrebase(s, strlen(s), _CBS_CCBASE, NULL);
+}
+
+static char *
+_cbs_ccunnorm(const char *s)
+{
+	return _cbs_ccsubst(s, strlen(s), _CBS_CCBASE, _cbs_ccbase, NULL);
+}
+
+/* Return whether the compiler command cmd writes split DWARF, in which case
+   the object embeds the name of its .dwo file */
+static bool
+_cbs_splitdwarf(struct strs cmd)
+{
+	for (size_t i = 0; i < cmd.len; i++) {
+		if (strncmp(cmd.buf[i], "-gsplit-dwarf", 13) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Build the command that is actually run, which maps the base directory
+   to ‘.’ in debug info and __FILE__ so that objects built in different
+   checkouts are identical.  Returns the injected flag, which the caller
+   must free. */
+static char *
+_cbs_ccprep(struct strs cmd, struct strs *run)
+{
+	char *flag = NULL;
+
+	for (size_t i = 1; i < cmd.len; i++) {
+		if (strncmp(cmd.buf[i], "-ffile-prefix-map=", 18) == 0
+		 || strncmp(cmd.buf[i], "-fdebug-prefix-map=", 19) == 0)
+		{
+			goto out;
+		}
+	}
+	if (cmd.len > 0 && strcmp(_cbs_ccbase, "/") != 0 && cckind() != CC_UNKNOWN) {
+		assert((flag = malloc(strlen(_cbs_ccbase) + 21)) != NULL);
+		sprintf(flag, "-ffile-prefix-map=%s=.", _cbs_ccbase);
+		strspush(run, cmd.buf, 1);
+		strspushl(run, flag);
+		strspush(run, cmd.buf + 1, cmd.len - 1);
+		return flag;
+	}
+
+out:
+	strspush(run, cmd.buf, cmd.len);
+	return flag;
+}
+
+/* Sort runs of consecutive -D flags, as long as they define distinct
+   macros, since their order then doesn’t affect the compilation */
+static void
+_cbs_ccsortdefs(char **xs, size_t n)
+{
+	for (size_t i = 0, j; i < n; i = j > i ? j : i + 1) {
+		for (j = i; j < n && strncmp(xs[j], "-D", 2) == 0 && xs[j][2]; j++)
+			;
+		if (j - i < 2)
+			continue;
+
+		char **ys = malloc((j - i) * sizeof(*ys));
+		assert(ys != NULL);
+		memcpy(ys, xs + i, (j - i) * sizeof(*ys));
+		qsort(ys, j - i, sizeof(*ys), _cbs_strcmp);
+
+		bool distinct = true;
+		for (size_t k = 1; distinct && k < j - i; k++) {
+			size_t a = strcspn(ys[k - 1] + 2, "="), b = strcspn(ys[k] + 2, "=");
+			distinct = a != b || strncmp(ys[k - 1] + 2, ys[k] + 2, a) != 0;
+		}
+		if (distinct)
+			memcpy(xs + i, ys, (j - i) * sizeof(*ys));
+		free(ys);
+	}
+}
+
+/* Read the entire file f into a null-terminated buffer */
+static bool
+_cbs_readall(const char *f, char **buf, size_t *n)
+{
+	int fd;
+	struct stat sb;
+
+	if ((fd = _cbs_open(f, O_RDONLY)) == -1)
+		return false;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return false;
+	}
+
+	*n = 0;
+	assert((*buf = malloc(sb.st_size + 1)) != NULL);
+	for (ssize_t nr; *n < (size_t)sb.st_size; *n += nr) {
+		if ((nr = read(fd, *buf + *n, sb.st_size - *n)) <= 0)
+			break;
+	}
+	close(fd);
+	(*buf)[*n] = 0;
+	return true;
+}
+
+/* Return a temporary name next to f that is unique to this process and
+   call, so that concurrent writers never share a temporary file */
+static char *
+_cbs_tmpname(const char *f)
+{
+	static unsigned long cnt;
+	_CBS_MUTEX(mtx);
+
+	_cbs_lock(mtx);
+	unsigned long n = cnt++;
+	_cbs_unlock(mtx);
+
+	char *tmp = malloc(strlen(f) + 64);
+	assert(tmp != NULL);
+	sprintf(tmp, "%s.%ld.%lu.tmp", f, (long)getpid(), n);
+	return tmp;
+}
+
+/* Atomically replace the file f with the n bytes at buf */
+static bool
+_cbs_writeall(const char *f, const void *buf, size_t n)
+{
+	int fd;
+	bool ok = true;
+	char *tmp = _cbs_tmpname(f);
+
+	if (!mkdirpf(f) || (fd = _cbs_open(tmp, O_WRONLY | O_CREAT | O_EXCL)) == -1) {
+		free(tmp);
+		return false;
+	}
+	for (size_t off = 0; off < n;) {
+		ssize_t nw = write(fd, (const char *)buf + off, n - off);
+		if (nw == -1) {
+			ok = false;
+			break;
+		}
+		off += nw;
+	}
+	if (close(fd) == -1)
+		ok = false;
+	if (ok)
+		ok = renameat(_cbs_dirfd, tmp, _cbs_dirfd, f) != -1;
+	if (!ok)
+		unlinkat(_cbs_dirfd, tmp, 0);
+	free(tmp);
+	return ok;
+}
+
+/* Open the file f relative to the script directory for reading */
+static FILE *
+_cbs_fload(const char *f)
+{
+	FILE *fp;
+	int fd = _cbs_open(f, O_RDONLY);
+
+	if (fd == -1)
+		return NULL;
+	if ((fp = fdopen(fd, "r")) == NULL)
+		close(fd);
+	return fp;
+}
+
+/* Atomically replace the file f with what fn writes.  Each write goes
+   through its own temporary file, so build scripts sharing a cache never
+   clobber each other’s partial writes; the last one to finish wins. */
+static void
+_cbs_fsave(const char *f, void (*fn)(FILE *))
+{
+	char *buf;
+	size_t n;
+	FILE *fp = open_memstream(&buf, &n);
+
+	assert(fp != NULL);
+	fn(fp);
+	assert(fclose(fp) != EOF);
+	_cbs_writeall(f, buf, n);
+	free(buf);
+}
+
+/* Atomically replace the file dst with a copy of the file src */
+static bool
+_cbs_fcopy(const char *src, const char *dst)
+{
+	int in, out;
+	bool ok = true;
+	char *tmp = _cbs_tmpname(dst);
+	static const size_t bufsz = 256 * 1024;
+
+	if ((in = _cbs_open(src, O_RDONLY)) == -1) {
+		free(tmp);
+		return false;
+	}
+	if (!mkdirpf(dst) || (out = _cbs_open(tmp, O_WRONLY | O_CREAT | O_EXCL)) == -1) {
+		close(in);
+		free(tmp);
+		return false;
+	}
+
+	char *buf = malloc(bufsz);
+	assert(buf != NULL);
+	for (ssize_t nr; ok && (nr = read(in, buf, bufsz)) != 0;) {
+		if (nr == -1) {
+			ok = false;
+			break;
+		}
+		for (ssize_t off = 0; off < nr;) {
+			ssize_t nw = write(out, buf + off, nr - off);
+			if (nw == -1) {
+				ok = false;
+				break;
+			}
+			off += nw;
+		}
+	}
+	free(buf);
+	close(in);
+	if (close(out) == -1)
+		ok = false;
+	if (ok)
+		ok = renameat(_cbs_dirfd, tmp, _cbs_dirfd, dst) != -1;
+	if (!ok)
+		unlinkat(_cbs_dirfd, tmp, 0);
+	free(tmp);
+	return ok;
+}
+
+/* Return the path of the cache entry of the given kind for the hash h.
+   Entries are spread over 256 subdirectories to keep directories small. */
+static char *
+_cbs_ccpath(char kind, struct hash128 h)
+{
+	char hex[33];
+	char *p = malloc(strlen(_cbs_ccdir) + 40);
+	assert(p != NULL);
+	_cbs_hhex(h, hex);
+	sprintf(p, "%s/%c/%.2s/%s", _cbs_ccdir, kind, hex, hex + 2);
+	return p;
+}
+
+/* Cached blobs may be compressed with zstd, which is recognized by the
+   frame’s magic number so that compressed and uncompressed entries can
+   be mixed.  Decompress the n bytes at *buf in place if needed. */
+static bool
+_cbs_ccdecomp(char **buf, size_t *n)
+{
+	static const unsigned char magic[] = {0x28, 0xB5, 0x2F, 0xFD};
+
+	if (*n < sizeof(magic) || memcmp(*buf, magic, sizeof(magic)) != 0)
+		return true;
+#ifdef CBS_ZSTD
+	unsigned long long sz = ZSTD_getFrameContentSize(*buf, *n);
+	if (sz == ZSTD_CONTENTSIZE_UNKNOWN || sz == ZSTD_CONTENTSIZE_ERROR)
+		return false;
+
+	char *out = malloc(sz + 1);
+	assert(out != NULL);
+	size_t got = ZSTD_decompress(out, sz, *buf, *n);
+	if (ZSTD_isError(got) || got != sz) {
+		free(out);
+		return false;
+	}
+	out[sz] = 0;
+	free(*buf);
+	*buf = out;
+	*n = sz;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Read the blob with hash h from the local cache */
+static bool
+_cbs_ccgetblob(struct hash128 h, char **buf, size_t *n)
+{
+	char *path = _cbs_ccpath('c', h);
+	bool ok = _cbs_readall(path, buf, n);
+	free(path);
+	if (ok && !(ok = _cbs_ccdecomp(buf, n)))
+		free(*buf);
+	return ok;
+}
+
+/* Write the n bytes at buf to the cache entry at path, compressing them if
+   zstd support is enabled, and store the size on disk in disk */
+static bool
+_cbs_ccputblob(const char *path, const char *buf, size_t n, size_t *disk)
+{
+#ifdef CBS_ZSTD
+	size_t cap = ZSTD_compressBound(n);
+	char *out = malloc(cap);
+	assert(out != NULL);
+	size_t sz = ZSTD_compress(out, cap, buf, n, 3);
+	bool ok = !ZSTD_isError(sz) && _cbs_writeall(path, out, sz);
+	free(out);
+	*disk = sz;
+	return ok;
+#else
+	*disk = n;
+	return _cbs_writeall(path, buf, n);
+#endif
+}
+
+/* The total size of the cache is tracked in a file shared by all processes
+   using the cache and updated under an exclusive lock.  It only needs to
+   be roughly right, as eviction recounts it. */
+static size_t _cbs_cclimit;
+static bool   _cbs_ccevrun, _cbs_ccevdone;
+#ifndef CBS_NO_THREADS
+static pthread_t _cbs_ccevthr;
+#endif
+_CBS_MUTEX(_cbs_ccevmtx);
+
+static void _cbs_ccevstart(void);
+
+static char *
+_cbs_ccfile(const char *name)
+{
+	return _cbs_pathjoin(_cbs_ccdir, name);
+}
+
+/* Add delta to the recorded size of the cache, returning the new size.  If
+   set is true the size is instead set to delta plus whatever was added
+   since the size was base. */
+static uint64_t
+_cbs_ccsize(int64_t delta, bool set, uint64_t base)
+{
+	char *path = _cbs_ccfile("size"), buf[32];
+	uint64_t sz = 0;
+	int fd;
+
+	fd = _cbs_open(path, O_RDWR | O_CREAT);
+	free(path);
+	if (fd == -1)
+		return 0;
+	if (flock(fd, LOCK_EX) == -1) {
+		close(fd);
+		return 0;
+	}
+
+	ssize_t nr = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (nr > 0) {
+		buf[nr] = 0;
+		sz = strtoull(buf, NULL, 10);
+	}
+	if (set)
+		sz = sz >= base ? sz - base + delta : (uint64_t)delta;
+	else
+		sz = delta < 0 && (uint64_t)-delta > sz ? 0 : sz + delta;
+
+	/* Use a fixed width so that the file never needs truncating */
+	int n = snprintf(buf, sizeof(buf), "%020llu\n", (unsigned long long)sz);
+	if (pwrite(fd, buf, n, 0) != n)
+		sz = 0;
+	close(fd);
+	return sz;
+}
+
+static void
+_cbs_ccaccount(int64_t delta)
+{
+	if (_cbs_ccsize(delta, false, 0) > _cbs_cclimit && _cbs_cclimit > 0)
+		_cbs_ccevstart();
+}
+
+/* Mark the cache entry at path as recently used */
+static void
+_cbs_cctouch(const char *path)
+{
+	if (_cbs_cclimit > 0)
+		utimensat(_cbs_dirfd, path, NULL, 0);
+}
+
+struct _cbs_ccent {
+	char *path;
+	time_t mtime;
+	uint64_t size;
+};
+
+static int
+_cbs_ccentcmp(const void *x, const void *y)
+{
+	const struct _cbs_ccent *a = x, *b = y;
+	return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+/* Remove the least recently used entries until the cache is under 90% of
+   its size limit, so that eviction doesn’t rerun on every insertion.  Only
+   one process evicts at a time; the others simply skip it. */
+static void *
+_cbs_ccevict(void *arg)
+{
+	char *path;
+	int lfd;
+	struct _cbs_ccent *es = NULL;
+	size_t n = 0, cap = 0;
+	uint64_t total = 0, base;
+	time_t now = time(NULL);
+
+	(void)arg;
+	path = _cbs_ccfile("evict.lock");
+	lfd = _cbs_open(path, O_RDWR | O_CREAT);
+	free(path);
+	if (lfd == -1)
+		goto out;
+	if (flock(lfd, LOCK_EX | LOCK_NB) == -1) {
+		close(lfd);
+		goto out;
+	}
+
+	base = _cbs_ccsize(0, false, 0);
+	for (const char *k = "acm"; *k; k++) {
+		for (int i = 0; i < 256; i++) {
+			char sub[8];
+			DIR *dp;
+			struct dirent *de;
+			int fd;
+
+			sprintf(sub, "%c/%02x", *k, i);
+			path = _cbs_ccfile(sub);
+			fd = openat(_cbs_dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd == -1 || (dp = fdopendir(fd)) == NULL) {
+				if (fd != -1)
+					close(fd);
+				free(path);
+				continue;
+			}
+
+			while ((de = readdir(dp)) != NULL) {
+				struct stat sb;
+				if (*de->d_name == '.'
+				 || fstatat(fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1
+				 || !S_ISREG(sb.st_mode))
+				{
+					continue;
+				}
+
+				/* Clean up after writers that died mid-insertion */
+				size_t len = strlen(de->d_name);
+				if (len > 4 && strcmp(de->d_name + len - 4, ".tmp") == 0) {
+					if (now - sb.st_mtim.tv_sec > 3600)
+						unlinkat(fd, de->d_name, 0);
+					continue;
+				}
+
+				if (n == cap) {
+					cap = cap == 0 ? 1024 : cap * 2;
+					assert((es = realloc(es, cap * sizeof(*es))) != NULL);
+				}
+				es[n].path = _cbs_pathjoin(path, de->d_name);
+				es[n].mtime = sb.st_mtim.tv_sec;
+				es[n].size = sb.st_size;
+				total += es[n++].size;
+			}
+			closedir(dp);
+			free(path);
+		}
+	}
+
+	qsort(es, n, sizeof(*es), _cbs_ccentcmp);
+	for (size_t i = 0; i < n; i++) {
+		if (total > _cbs_cclimit / 10 * 9
+		 && unlinkat(_cbs_dirfd, es[i].path, 0) == 0)
+		{
+			total -= es[i].size;
+		}
+		free(es[i].path);
+	}
+	free(es);
+
+	_cbs_ccsize(total, true, base);
+	close(lfd);
+
+out:
+	_cbs_lock(_cbs_ccevmtx);
+	_cbs_ccevrun = false;
+	_cbs_ccevdone = true;
+	_cbs_unlock(_cbs_ccevmtx);
+	return NULL;
+}
+
+/* Start evicting entries in the background, unless we’re already doing
+   so.  Without threads, eviction is deferred until the process exits. */
+static void
+_cbs_ccevstart(void)
+{
+	_cbs_lock(_cbs_ccevmtx);
+	if (_cbs_ccevrun) {
+		_cbs_unlock(_cbs_ccevmtx);
+		return;
+	}
+	_cbs_ccevrun = true;
+#ifndef CBS_NO_THREADS
+	if (_cbs_ccevdone)
+		pthread_join(_cbs_ccevthr, NULL);
+	_cbs_ccevdone = false;
+	assert(pthread_create(&_cbs_ccevthr, NULL, _cbs_ccevict, NULL) == 0);
+#endif
+	_cbs_unlock(_cbs_ccevmtx);
+}
+
+static void
+_cbs_ccevwait(void)
+{
+#ifdef CBS_NO_THREADS
+	if (_cbs_ccevrun)
+		_cbs_ccevict(NULL);
+#else
+	_cbs_lock(_cbs_ccevmtx);
+	bool started = _cbs_ccevrun || _cbs_ccevdone;
+	_cbs_unlock(_cbs_ccevmtx);
+	if (started)
+		pthread_join(_cbs_ccevthr, NULL);
+#endif
+}
+
+void
+cachelimit(size_t bytes)
+{
+	static bool registered;
+
+	if (!registered) {
+		atexit(_cbs_ccevwait);
+		registered = true;
+	}
+	_cbs_cclimit = bytes;
+	if (bytes == 0 || _cbs_ccdir == NULL)
+		return;
+
+	/* A cache populated by older versions has no recorded size, so it
+	   must be counted */
+	char *path = _cbs_ccfile("size");
+	bool counted = fexists(path);
+	free(path);
+	if (!counted || _cbs_ccsize(0, false, 0) > bytes)
+		_cbs_ccevstart();
+}
+
+/* The remote cache is any HTTP server that answers GET requests for files
+   previously stored with PUT requests, using the same layout as the local
+   cache directory */
+static struct {
+	char *host, *port, *prefix;
+	bool dead;
+} _cbs_ccremote;
+
+_CBS_MUTEX(_cbs_ccrmtx);
+
+void
+cacheremote(const char *url)
+{
+	const char *p, *q;
+
+	free(_cbs_ccremote.host);
+	free(_cbs_ccremote.port);
+	free(_cbs_ccremote.prefix);
+	_cbs_ccremote.host = _cbs_ccremote.port = _cbs_ccremote.prefix = NULL;
+	_cbs_ccremote.dead = false;
+	if (url == NULL)
+		return;
+
+	if (strncmp(url, "http://", 7) != 0) {
+		fprintf(stderr, "%s: unsupported cache URL: %s\n", *_cbs_argv, url);
+		return;
+	}
+	url += 7;
+
+	p = url + strcspn(url, ":/");
+	assert((_cbs_ccremote.host = strndup(url, p - url)) != NULL);
+	if (*p == ':') {
+		q = p + 1 + strcspn(p + 1, "/");
+		assert((_cbs_ccremote.port = strndup(p + 1, q - p - 1)) != NULL);
+		p = q;
+	} else
+		assert((_cbs_ccremote.port = strdup("80")) != NULL);
+
+	/* Strip trailing slashes so paths can simply be appended */
+	size_t n = strlen(p);
+	while (n > 0 && p[n - 1] == '/')
+		n--;
+	assert((_cbs_ccremote.prefix = strndup(p, n)) != NULL);
+}
+
+/* Perform an HTTP request for path on the remote cache, returning the
+   status code or -1 on error.  The response body is stored in resp if it
+   is non-NULL. */
+static int
+_cbs_httpreq(const char *method, const char *path, const void *body,
+             size_t bodysz, char **resp, size_t *respsz)
+{
+	int fd = -1, status = -1;
+	struct addrinfo hints = {0}, *ai, *it;
+	char *req = NULL, *buf = NULL;
+	size_t n = 0, cap = 0;
+
+	_cbs_lock(_cbs_ccrmtx);
+	bool dead = _cbs_ccremote.dead;
+	_cbs_unlock(_cbs_ccrmtx);
+	if (dead)
+		return -1;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(_cbs_ccremote.host, _cbs_ccremote.port, &hints, &ai) == 0) {
+		for (it = ai; it != NULL; it = it->ai_next) {
+			fd = socket(it->ai_family, it->ai_socktype | SOCK_CLOEXEC,
+			            it->ai_protocol);
+			if (fd == -1)
+				continue;
+			struct timeval tv = {.tv_sec = 10};
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			if (connect(fd, it->ai_addr, it->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(ai);
+	}
+
+	/* Don’t slow down every compilation with a cache that’s unreachable */
+	if (fd == -1) {
+		_cbs_lock(_cbs_ccrmtx);
+		if (!_cbs_ccremote.dead) {
+			fprintf(stderr, "%s: remote cache %s:%s unreachable; disabling it\n",
+			        *_cbs_argv, _cbs_ccremote.host, _cbs_ccremote.port);
+		}
+		_cbs_ccremote.dead = true;
+		_cbs_unlock(_cbs_ccrmtx);
+		return -1;
+	}
+
+	size_t reqsz = strlen(method) + strlen(_cbs_ccremote.prefix) + strlen(path)
+	             + strlen(_cbs_ccremote.host) + 128;
+	assert((req = malloc(reqsz)) != NULL);
+	reqsz = snprintf(req, reqsz,
+	                 "%s %s/%s HTTP/1.1\r\n"
+	                 "Host: %s\r\n"
+	                 "Content-Length: %zu\r\n"
+	                 "Connection: close\r\n\r\n",
+	                 method, _cbs_ccremote.prefix, path, _cbs_ccremote.host,
+	                 body != NULL ? bodysz : 0);
+
+#ifdef MSG_NOSIGNAL
+#	define _CBS_SENDFL MSG_NOSIGNAL
+#else
+#	define _CBS_SENDFL 0
+#endif
+	for (int i = 0; i < 2; i++) {
+		const char *p = i == 0 ? req : body;
+		size_t len = i == 0 ? reqsz : body != NULL ? bodysz : 0;
+		for (size_t off = 0; off < len;) {
+			ssize_t nw = send(fd, p + off, len - off, _CBS_SENDFL);
+			if (nw <= 0)
+				goto out;
+			off += nw;
+		}
+	}
+#undef _CBS_SENDFL
+
+	for (;;) {
+		if (n + 65536 > cap) {
+			cap = (n + 65536) * 2;
+			assert((buf = realloc(buf, cap + 1)) != NULL);
+		}
+		ssize_t nr = recv(fd, buf + n, cap - n, 0);
+		if (nr < 0)
+			goto out;
+		if (nr == 0)
+			break;
+		n += nr;
+	}
+	if (buf == NULL)
+		goto out;
+	buf[n] = 0;
+
+	char *hdrend = strstr(buf, "\r\n\r\n");
+	if (hdrend == NULL || sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1) {
+		status = -1;
+		goto out;
+	}
+	if (resp != NULL) {
+		char *body = hdrend + 4;
+		size_t len = n - (body - buf);
+
+		/* Trust Content-Length over the end of the stream when present */
+		for (char *h = strstr(buf, "\r\n"); h != NULL && h < hdrend;
+		     h = strstr(h + 2, "\r\n"))
+		{
+			unsigned long long cl;
+			if (strncasecmp(h + 2, "Content-Length:", 15) == 0
+			 && sscanf(h + 17, "%llu", &cl) == 1 && cl < len)
+			{
+				len = cl;
+			}
+		}
+
+		assert((*resp = malloc(len + 1)) != NULL);
+		memcpy(*resp, body, len);
+		(*resp)[len] = 0;
+		*respsz = len;
+	}
+
+out:
+	close(fd);
+	free(req);
+	free(buf);
+	return status;
+}
+
+/* Merge the remote manifest of rn bytes at rbuf into the local manifest of
+   ln bytes at lbuf.  The local entries are kept first, followed by the
+   remote entries whose result isn’t listed locally, up to the same limit
+   _cbs_ccstore() enforces. */
+static char *
+_cbs_ccmerge(const char *lbuf, size_t ln, const char *rbuf, size_t rn,
+             size_t *outsz)
+{
+	char *m;
+	const char *p, *e, *next, *end = rbuf + rn;
+	int ents = 0;
+	FILE *fp = open_memstream(&m, outsz);
+
+	assert(fp != NULL);
+	fwrite(lbuf, 1, ln, fp);
+	for (p = lbuf; (p = memmem(p, lbuf + ln - p, "result ", 7)) != NULL; p++)
+		ents++;
+
+	/* Each entry is a 40 byte result line followed by its headers */
+	for (e = rbuf; e + 40 <= end && ents < 33; e = next) {
+		if (memcmp(e, "result ", 7) != 0)
+			break;
+		next = memmem(e + 1, end - e - 1, "\nresult ", 8);
+		next = next != NULL ? next + 1 : end;
+		if (memmem(lbuf, ln, e, 40) != NULL)
+			continue;
+		fwrite(e, 1, next - e, fp);
+		if (next[-1] != '\n')
+			fputc('\n', fp);
+		ents++;
+	}
+
+	assert(fclose(fp) != EOF);
+	return m;
+}
+
+/* Make sure the cache entry of the given kind for h exists locally,
+   downloading it from the remote cache if needed or if force is true */
+static bool
+_cbs_ccpull(char kind, struct hash128 h, bool force)
+{
+	char *path = _cbs_ccpath(kind, h), *buf;
+	size_t n;
+	bool ok;
+
+	if ((!force && fexists(path)) || _cbs_ccremote.host == NULL) {
+		ok = fexists(path);
+		free(path);
+		return ok;
+	}
+
+	const char *rel = path + strlen(_cbs_ccdir) + 1;
+	if ((ok = _cbs_httpreq("GET", rel, NULL, 0, &buf, &n) == 200)) {
+		/* Blobs are content-addressed, so verify what we received */
+		if (kind == 'c') {
+			char *data = malloc(n + 1);
+			size_t dn = n;
+			assert(data != NULL);
+			memcpy(data, buf, n);
+			if ((ok = _cbs_ccdecomp(&data, &dn))) {
+				struct hash128 got = memhash(data, dn);
+				ok = got.lo == h.lo && got.hi == h.hi;
+			}
+			free(data);
+		}
+		/* Don’t lose header sets only known locally */
+		char *old;
+		size_t oldn = 0;
+		if (ok && kind == 'm' && _cbs_readall(path, &old, &oldn)) {
+			char *m = _cbs_ccmerge(old, oldn, buf, n, &n);
+			free(buf);
+			free(old);
+			buf = m;
+		}
+		if ((ok = ok && _cbs_writeall(path, buf, n)))
+			_cbs_ccaccount((int64_t)n - oldn);
+		free(buf);
+	}
+	if (!ok)
+		ok = fexists(path);
+	free(path);
+	return ok;
+}
+
+/* Upload the local cache entry of the given kind for h to the remote
+   cache, if there is one */
+static void
+_cbs_ccpush(char kind, struct hash128 h)
+{
+	char *path, *buf;
+	size_t n;
+
+	if (_cbs_ccremote.host == NULL)
+		return;
+	path = _cbs_ccpath(kind, h);
+	if (_cbs_readall(path, &buf, &n)) {
+		_cbs_httpreq("PUT", path + strlen(_cbs_ccdir) + 1, buf, n, NULL, NULL);
+		free(buf);
+	}
+	free(path);
+}
+
+static void
+_cbs_hstr(struct _cbs_hstate *st, const char *s)
+{
+	_cbs_hupdate(st, s, strlen(s) + 1);
+}
+
+/* Return the path of the executable name would run, or NULL */
+static char *
+_cbs_which(const char *name)
+{
+	const char *path = getenv("PATH");
+	char *p, *it, *save;
+
+	if (strchr(name, '/') != NULL) {
+		assert((p = strdup(name)) != NULL);
+		return p;
+	}
+	if (path == NULL)
+		return NULL;
+
+	assert((p = strdup(path)) != NULL);
+	for (it = strtok_r(p, ":", &save); it != NULL;
+	     it = strtok_r(NULL, ":", &save))
+	{
+		char *f = _cbs_pathjoin(it, name);
+		if (access(f, X_OK) == 0) {
+			free(p);
+			return f;
+		}
+		free(f);
+	}
+	free(p);
+	return NULL;
+}
+
+/* The direct key identifies a compilation by the compiler binary, its
+   command and the contents of its source file.  It doesn’t cover the
+   headers the source includes, as they aren’t known until the source is
+   compiled. */
+static bool
+_cbs_ccdkey(struct strs cmd, const char *src, struct hash128 *key)
+{
+	struct hash128 h, cch;
+	struct _cbs_hstate st;
+	char *cc;
+	bool ok;
+
+	/* Objects built by one compiler must never be handed out for another,
+	   such as after an upgrade or on a remote cache shared by machines
+	   with different toolchains */
+	if (cmd.len == 0 || (cc = _cbs_which(cmd.buf[0])) == NULL)
+		return false;
+	ok = fhash(cc, &cch);
+	free(cc);
+	if (!ok || !fhash(src, &h))
+		return false;
+
+	/* Make the key independent of where the checkout lives */
+	char **args = malloc((cmd.len + 1) * sizeof(*args));
+	assert(args != NULL);
+	for (size_t i = 0; i < cmd.len; i++)
+		args[i] = _cbs_ccrebase(cmd.buf[i], strlen(cmd.buf[i]), ".", NULL);
+	_cbs_ccsortdefs(args, cmd.len);
+
+	_cbs_hinit(&st);
+	_cbs_hstr(&st, "cbs-cc 3");
+	_cbs_hupdate(&st, &cch, sizeof(cch));
+	for (size_t i = 0; i < cmd.len; i++) {
+		_cbs_hstr(&st, args[i]);
+		free(args[i]);
+	}
+	free(args);
+	_cbs_hupdate(&st, &h, sizeof(h));
+	*key = _cbs_hfinal(&st);
+	return true;
+}
+
+/* A manifest lists, for a direct key, every set of headers the source was
+   seen to include along with their hashes and the resulting object.  Look
+   for a set whose headers are all unchanged. */
+static bool
+_cbs_ccmanifest(struct hash128 dkey, struct hash128 *rkey)
+{
+	char *path = _cbs_ccpath('m', dkey), *buf, *line, *next;
+	size_t n;
+	bool ok = false, match = false;
+
+	if (!_cbs_readall(path, &buf, &n)) {
+		free(path);
+		return false;
+	}
+
+	for (line = buf; line != NULL && *line != 0; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = 0;
+
+		struct hash128 want, have;
+		if (strncmp(line, "result ", 7) == 0) {
+			if (match) {
+				ok = true;
+				break;
+			}
+			match = _cbs_hunhex(line + 7, rkey);
+		} else if (match && strlen(line) > 33 && _cbs_hunhex(line, &want)) {
+			char *hdr = _cbs_ccunnorm(line + 33);
+			match = fhash(hdr, &have) && have.lo == want.lo
+			     && have.hi == want.hi;
+			free(hdr);
+		}
+	}
+	ok = ok || match;
+	if (ok)
+		_cbs_cctouch(path);
+
+	free(buf);
+	free(path);
+	return ok;
+}
+
+static bool
+_cbs_ccfetch(struct hash128 rkey, const char *obj, const char *dep)
+{
+	struct hash128 objh, deph;
+	char *path = _cbs_ccpath('a', rkey), *buf;
+	size_t n;
+	bool ok;
+
+	ok = _cbs_ccpull('a', rkey, false) && _cbs_readall(path, &buf, &n);
+	if (ok)
+		_cbs_cctouch(path);
+	free(path);
+	if (!ok)
+		return false;
+	ok = n >= 65 && _cbs_hunhex(buf, &objh) && _cbs_hunhex(buf + 33, &deph);
+	free(buf);
+	if (!ok)
+		return false;
+
+	if ((ok = _cbs_ccpull('c', objh, false) && _cbs_ccgetblob(objh, &buf, &n))) {
+		ok = _cbs_writeall(obj, buf, n);
+		free(buf);
+	}
+	if (ok && dep != NULL
+	 && (ok = _cbs_ccpull('c', deph, false) && _cbs_ccgetblob(deph, &buf, &n)))
+	{
+		char *s = _cbs_ccsubst(buf, n, _CBS_CCBASE, _cbs_ccbase, &n);
+		ok = _cbs_writeall(dep, s, n);
+		free(s);
+		free(buf);
+	}
+
+	/* Blobs are shared between entries, so only touch them on a hit */
+	for (int i = 0; ok && i < 1 + (dep != NULL); i++) {
+		path = _cbs_ccpath('c', i == 0 ? objh : deph);
+		_cbs_cctouch(path);
+		free(path);
+	}
+	return ok;
+}
+
+static bool
+_cbs_ccstoreblob(const char *f, struct hash128 *h, bool norm)
+{
+	/* Outputs are freshly written, so they must always be rehashed */
+	char *path;
+	char *buf;
+	size_t n;
+	bool ok;
+
+	if (!_cbs_readall(f, &buf, &n))
+		return false;
+	if (norm) {
+		char *s = _cbs_ccrebase(buf, n, _CBS_CCBASE, &n);
+		free(buf);
+		buf = s;
+	}
+	*h = memhash(buf, n);
+	path = _cbs_ccpath('c', *h);
+	size_t disk;
+	if (!(ok = fexists(path)) && (ok = _cbs_ccputblob(path, buf, n, &disk))) {
+		_cbs_ccaccount(disk);
+		_cbs_ccpush('c', *h);
+	}
+	free(path);
+	free(buf);
+	return ok;
+}
+
+static void
+_cbs_ccstore(struct hash128 dkey, const char *obj, const char *dep,
+             time_t start)
+{
+	struct strs hdrs = {0};
+	struct hash128 objh, deph = {0}, rkey;
+	struct _cbs_hstate st;
+	char hex[33], *path, *buf, *ent = NULL;
+	size_t n, entsz = 0;
+
+	if (dep != NULL && !depread(&hdrs, dep))
+		return;
+
+	/* Hash the headers, and give up if any changed during the compilation
+	   as we can’t know which version the compiler saw */
+	_cbs_hinit(&st);
+	_cbs_hupdate(&st, &dkey, sizeof(dkey));
+	FILE *fp = open_memstream(&ent, &entsz);
+	assert(fp != NULL);
+	for (size_t i = 0; i < hdrs.len; i++) {
+		struct stat sb;
+		struct hash128 h;
+		if (_cbs_stat(hdrs.buf[i], &sb) == -1 || sb.st_mtim.tv_sec >= start
+		 || !fhash(hdrs.buf[i], &h))
+		{
+			fclose(fp);
+			goto out;
+		}
+		char *hdr = _cbs_ccnorm(hdrs.buf[i]);
+		_cbs_hstr(&st, hdr);
+		_cbs_hupdate(&st, &h, sizeof(h));
+		_cbs_hhex(h, hex);
+		fprintf(fp, "%s %s\n", hex, hdr);
+		free(hdr);
+	}
+	fclose(fp);
+	rkey = _cbs_hfinal(&st);
+
+	if (!_cbs_ccstoreblob(obj, &objh, false)
+	 || (dep != NULL && !_cbs_ccstoreblob(dep, &deph, true)))
+	{
+		goto out;
+	}
+
+	char res[67];
+	_cbs_hhex(objh, res);
+	res[32] = ' ';
+	_cbs_hhex(deph, res + 33);
+	res[65] = '\n';
+	path = _cbs_ccpath('a', rkey);
+	bool ok = _cbs_writeall(path, res, 66);
+	free(path);
+	if (!ok)
+		goto out;
+	_cbs_ccaccount(66);
+	_cbs_ccpush('a', rkey);
+
+	/* Prepend the new entry to the manifest, so that the most recent
+	   header set is tried first */
+	path = _cbs_ccpath('m', dkey);
+	if (!_cbs_readall(path, &buf, &n)) {
+		buf = NULL;
+		n = 0;
+	}
+	size_t oldn = n;
+	_cbs_hhex(rkey, hex);
+
+	/* Keep the manifest from growing without bounds */
+	char *cut = buf;
+	for (int i = 0; cut != NULL && i < 32; i++) {
+		if ((cut = strstr(cut, "result ")) != NULL)
+			cut++;
+	}
+	if (cut != NULL)
+		n = cut - 1 - buf;
+
+	char *m = malloc(entsz + n + 64);
+	assert(m != NULL);
+	size_t mn = sprintf(m, "result %s\n", hex);
+	memcpy(m + mn, ent, entsz);
+	mn += entsz;
+	if (buf != NULL)
+		memcpy(m + mn, buf, n);
+	if (_cbs_writeall(path, m, mn + n)) {
+		_cbs_ccaccount((int64_t)mn + n - oldn);
+		_cbs_ccpush('m', dkey);
+	}
+	free(m);
+	free(buf);
+	free(path);
+
+out:
+	for (size_t i = 0; i < hdrs.len; i++)
+		free(hdrs.buf[i]);
+	strsfree(&hdrs);
+	free(ent);
+}
+
+int
+ccexec(struct strs cmd, const char *src, const char *obj, const char *dep)
+{
+	int ec;
+	char *flag;
+	struct strs run = {0};
+	struct hash128 dkey, rkey;
+
+	/* Only objects and dependency files are cached, so split DWARF would be
+	   restored without its .dwo file */
+	if (cbsopts.dryrun || _cbs_ccdir == NULL || _cbs_splitdwarf(cmd))
+		return cmdexec(cmd);
+
+	flag = _cbs_ccprep(cmd, &run);
+	if (!_cbs_ccdkey(run, src, &dkey))
+		ec = cmdexec(run);
+	else if (_cbs_ccmanifest(dkey, &rkey) && _cbs_ccfetch(rkey, obj, dep))
+		ec = EXIT_SUCCESS;
+	/* The remote manifest may know of header sets we haven’t seen */
+	else if (_cbs_ccremote.host != NULL && _cbs_ccpull('m', dkey, true)
+	      && _cbs_ccmanifest(dkey, &rkey) && _cbs_ccfetch(rkey, obj, dep))
+	{
+		ec = EXIT_SUCCESS;
+	} else {
+		time_t start = time(NULL);
+		if ((ec = cmdexec(run)) == EXIT_SUCCESS)
+			_cbs_ccstore(dkey, obj, dep, start);
+	}
+
+	free(flag);
+	strsfree(&run);
+	return ec;
+}
+
+/* Return the path of the dependency file for the object obj */
+static char *
+_cbs_depname(const char *obj)
+{
+	const char *dot = strrchr(obj, '.'), *sl = strrchr(obj, '/');
+	size_t n = dot != NULL && (sl == NULL || dot > sl) ? (size_t)(dot - obj)
+	                                                   : strlen(obj);
+	char *s = malloc(n + 3);
+	assert(s != NULL);
+	memcpy(s, obj, n);
+	strcpy(s + n, ".d");
+	return s;
+}
+
+static char *
+_cbs_abspath(const char *base, const char *p)
+{
+	char *s;
+	if (*p == '/')
+		assert((s = strdup(p)) != NULL);
+	else
+		s = _cbs_pathjoin(base, p);
+	return s;
+}
+
+/* Copy the dependency file src to dst, replacing the target of its first
+   rule with obj */
+static bool
+_cbs_depcopy(const char *src, const char *dst, const char *obj)
+{
+	char *buf, *p;
+	size_t n;
+	bool ok;
+
+	if (!_cbs_readall(src, &buf, &n))
+		return false;
+	for (p = buf; (p = strchr(p, ':')) != NULL; p++) {
+		if (strchr(" \t\r\n", p[1]) != NULL)
+			break;
+	}
+	if (p != NULL && obj != NULL) {
+		char *s = malloc(strlen(obj) + n - (p - buf) + 1);
+		assert(s != NULL);
+		size_t sn = sprintf(s, "%s", obj);
+		memcpy(s + sn, p, n - (p - buf));
+		sn += n - (p - buf);
+		ok = _cbs_writeall(dst, s, sn);
+		free(s);
+	} else
+		ok = _cbs_writeall(dst, buf, n);
+	free(buf);
+	return ok;
+}
+
+/* Move the outputs of a batch compiled in the directory tmp to their final
+   locations, fixing up the target of each dependency file */
+static bool
+_cbs_batchmv(const char *tmp, const char *stem, const char *obj)
+{
+	char *o, *d, *dep;
+	bool ok;
+
+	assert((o = malloc(strlen(tmp) + strlen(stem) + 4)) != NULL);
+	sprintf(o, "%s/%s.o", tmp, stem);
+	ok = mkdirpf(obj) && (renameat(_cbs_dirfd, o, _cbs_dirfd, obj) != -1
+	                      || (errno == EXDEV && _cbs_fcopy(o, obj)));
+	free(o);
+	if (!ok)
+		return false;
+
+	/* The target of the dependency file names the object as the compiler
+	   saw it */
+	assert((d = malloc(strlen(tmp) + strlen(stem) + 4)) != NULL);
+	sprintf(d, "%s/%s.d", tmp, stem);
+	dep = _cbs_depname(obj);
+	ok = _cbs_depcopy(d, dep, obj);
+	unlinkat(_cbs_dirfd, d, 0);
+	free(dep);
+	free(d);
+	return ok;
+}
+
+int
+ccbatch(struct strs cmd, char **srcs, char **objs, size_t n)
+{
+	static const char *pathopts[] = {
+		"-I", "-idirafter", "-imacros", "-include", "-iquote", "-isystem",
+	};
+	struct strs xs = {0}, owned = {0};
+	bool *done;
+	char *base;
+	size_t *batch, bn;
+	int ec = EXIT_SUCCESS;
+
+	if (n == 0)
+		return EXIT_SUCCESS;
+
+	/* The compiler runs in a temporary directory so that the outputs of
+	   different batches can’t collide, so relative paths must be made
+	   absolute */
+	base = _cbs_scriptdir();
+	strspush(&xs, cmd.buf, 1);
+	for (size_t i = 1; i < cmd.len; i++) {
+		char *arg = cmd.buf[i], *s = NULL;
+		for (size_t j = 0; s == NULL && j < lengthof(pathopts); j++) {
+			size_t len = strlen(pathopts[j]);
+			if (strncmp(arg, pathopts[j], len) != 0)
+				continue;
+			if (arg[len] == 0 && i + 1 < cmd.len) {
+				strspushl(&xs, arg);
+				s = _cbs_abspath(base, cmd.buf[++i]);
+			} else if (arg[len] != 0 && arg[len] != '/') {
+				char *p = _cbs_abspath(base, arg + len);
+				assert((s = malloc(len + strlen(p) + 1)) != NULL);
+				sprintf(s, "%s%s", pathopts[j], p);
+				free(p);
+			}
+		}
+		if (s != NULL) {
+			strspushl(&owned, s);
+			strspushl(&xs, s);
+		} else
+			strspushl(&xs, arg);
+	}
+	strspushl(&xs, "-MD", "-c");
+	size_t common = xs.len;
+
+	/* The compiler names each output after the basename of its source, so
+	   sources sharing a basename must go in separate batches */
+	assert((done = calloc(n, sizeof(*done))) != NULL);
+	assert((batch = malloc(n * sizeof(*batch))) != NULL);
+	char **stems = malloc(n * sizeof(*stems));
+	assert(stems != NULL);
+	for (size_t i = 0; i < n; i++) {
+		const char *b = strrchr(srcs[i], '/');
+		b = b != NULL ? b + 1 : srcs[i];
+		const char *dot = strrchr(b, '.');
+		assert((stems[i] = strndup(b, dot != NULL ? (size_t)(dot - b)
+		                                          : strlen(b))) != NULL);
+	}
+
+	for (size_t first = 0; ec == EXIT_SUCCESS && first < n;) {
+		struct _cbs_map seen = {0};
+		char *tmp, *dir;
+		int fd;
+
+		xs.len = common;
+		bn = 0;
+		for (size_t i = first; i < n; i++) {
+			if (done[i] || _cbs_mapget(&seen, stems[i], false) != NULL)
+				continue;
+			*_cbs_mapget(&seen, stems[i], true) = (void *)1;
+			done[i] = true;
+			char *s = _cbs_abspath(base, srcs[i]);
+			strspushl(&owned, s);
+			strspushl(&xs, s);
+			batch[bn++] = i;
+		}
+		while (first < n && done[first])
+			first++;
+		for (size_t i = 0; i < seen.cap; i++)
+			free(seen.buf[i].k);
+		free(seen.buf);
+
+		cmdput(xs);
+		if (cbsopts.dryrun)
+			continue;
+
+		/* Keep the temporary directory on the same filesystem as the
+		   objects so that they can be renamed into place */
+		const char *sl = strrchr(objs[batch[0]], '/');
+		if (sl != NULL) {
+			assert((dir = strndup(objs[batch[0]], sl - objs[batch[0]])) != NULL);
+			assert(mkdirp(dir));
+			char *p = _cbs_pathjoin(dir, ".cbs-batch");
+			tmp = _cbs_tmpname(p);
+			free(p);
+			free(dir);
+		} else
+			tmp = _cbs_tmpname(".cbs-batch");
+		assert(mkdirat(_cbs_dirfd, tmp, 0777) != -1);
+		assert((fd = openat(_cbs_dirfd, tmp, O_RDONLY | O_DIRECTORY
+		                                   | O_CLOEXEC)) != -1);
+
+		flockfile(stderr);
+		pid_t pid = fork();
+		assert(pid != -1);
+		if (pid == 0) {
+			assert(fchdir(fd) != -1);
+			execvp(xs.buf[0], xs.buf);
+			assert(!"failed to execute process");
+		}
+		ec = cmdwait(pid);
+		funlockfile(stderr);
+
+		for (size_t i = 0; ec == EXIT_SUCCESS && i < bn; i++) {
+			if (!_cbs_batchmv(tmp, stems[batch[i]], objs[batch[i]]))
+				ec = EXIT_FAILURE;
+		}
+
+		/* Clean up whatever a failed compilation left behind */
+		DIR *dp = fdopendir(fd);
+		assert(dp != NULL);
+		for (struct dirent *de; (de = readdir(dp)) != NULL;) {
+			if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+				unlinkat(fd, de->d_name, 0);
+		}
+		closedir(dp);
+		unlinkat(_cbs_dirfd, tmp, AT_REMOVEDIR);
+		free(tmp);
+	}
+
+	for (size_t i = 0; i < n; i++)
+		free(stems[i]);
+	for (size_t i = 0; i < owned.len; i++)
+		free(owned.buf[i]);
+	free(stems);
+	free(batch);
+	free(done);
+	free(base);
+	strsfree(&owned);
+	strsfree(&xs);
+	return ec;
+}
+
+/* Identical commands run through cmdexec_once() are only executed once.
+   Commands are identified by their arguments without the names of their
+   outputs (except for split DWARF compiles), which are then copied to the
+   outputs of each duplicate. */
+struct _cbs_once {
+	bool done;
+	int ec;
+	char *obj, *dep;
+};
+
+static struct _cbs_map _cbs_oncemap;
+_CBS_MUTEX(_cbs_oncemtx);
+#ifndef CBS_NO_THREADS
+static pthread_cond_t _cbs_oncecnd = PTHREAD_COND_INITIALIZER;
+#endif
+
+/* Hash the command cmd without its output names, and find the object and
+   dependency files it writes */
+static struct hash128
+_cbs_oncekey(struct strs cmd, const char **obj, const char **dep)
+{
+	static const char *outopts[] = {"-o", "-MF", "-MT", "-MQ"};
+	struct _cbs_hstate st;
+	bool md = false;
+
+	*obj = *dep = NULL;
+	_cbs_hinit(&st);
+	_cbs_hstr(&st, "cbs-once 1");
+	for (size_t i = 0; i < cmd.len; i++) {
+		const char *arg = cmd.buf[i], *val = NULL;
+		size_t j;
+
+		for (j = 0; j < lengthof(outopts); j++) {
+			size_t len = strlen(outopts[j]);
+			if (strncmp(arg, outopts[j], len) == 0) {
+				val = arg[len] != 0 ? arg + len : i + 1 < cmd.len ? cmd.buf[++i] : "";
+				break;
+			}
+		}
+		if (val == NULL) {
+			md = md || strcmp(arg, "-MD") == 0 || strcmp(arg, "-MMD") == 0;
+			_cbs_hstr(&st, arg);
+		} else {
+			/* Keep which options were given, just not their values */
+			_cbs_hstr(&st, outopts[j]);
+			if (j == 0)
+				*obj = val;
+			else if (j == 1)
+				*dep = val;
+		}
+	}
+	if (md && *dep == NULL && *obj != NULL)
+		*dep = "";
+
+	/* Split DWARF objects embed the name of their .dwo file, so they can’t
+	   be copied to another name */
+	if (*obj != NULL && _cbs_splitdwarf(cmd))
+		_cbs_hstr(&st, *obj);
+	return _cbs_hfinal(&st);
+}
+
+int
+cmdexec_once(struct strs cmd)
+{
+	const char *obj, *dep;
+	char hex[33], *mydep;
+	struct _cbs_once *o;
+	void **v;
+	bool ok = true;
+
+	if (cbsopts.dryrun)
+		return EXIT_SUCCESS;
+
+	_cbs_hhex(_cbs_oncekey(cmd, &obj, &dep), hex);
+	/* -MD without -MF names the dependency file after the object */
+	mydep = dep == NULL ? NULL : *dep != 0 ? strdup(dep) : _cbs_depname(obj);
+	assert(dep == NULL || mydep != NULL);
+
+	_cbs_lock(_cbs_oncemtx);
+	v = _cbs_mapget(&_cbs_oncemap, hex, true);
+	if (*v == NULL) {
+		assert((o = calloc(1, sizeof(*o))) != NULL);
+		if (obj != NULL)
+			assert((o->obj = strdup(obj)) != NULL);
+		o->dep = mydep;
+		*v = o;
+		_cbs_unlock(_cbs_oncemtx);
+
+		int ec = cmdexec(cmd);
+
+		_cbs_lock(_cbs_oncemtx);
+		o->ec = ec;
+		o->done = true;
+#ifndef CBS_NO_THREADS
+		pthread_cond_broadcast(&_cbs_oncecnd);
+#endif
+		_cbs_unlock(_cbs_oncemtx);
+		return ec;
+	}
+
+	o = *v;
+#ifndef CBS_NO_THREADS
+	while (!o->done)
+		pthread_cond_wait(&_cbs_oncecnd, &_cbs_oncemtx);
+#endif
+	_cbs_unlock(_cbs_oncemtx);
+
+	/* The outputs are copied rather than hard linked, as compilers may
+	   overwrite their outputs in place which would silently change the
+	   other copies once the commands diverge */
+	if (o->ec == EXIT_SUCCESS) {
+		if (obj != NULL && o->obj != NULL && strcmp(obj, o->obj) != 0)
+			ok = _cbs_fcopy(o->obj, obj);
+		if (ok && mydep != NULL && o->dep != NULL && strcmp(mydep, o->dep) != 0)
+			ok = _cbs_depcopy(o->dep, mydep, obj);
+	}
+	free(mydep);
+	return o->ec != EXIT_SUCCESS ? o->ec : ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#ifndef CBS_NO_THREADS
+struct _cbs_ccpf {
+	struct strs cmd;
+	char *src;
+};
+
+static void
+_cbs_ccpfjob(void *arg)
+{
+	struct _cbs_ccpf *pf = arg;
+	struct hash128 dkey, rkey, objh, deph;
+	struct strs run = {0};
+	char *path, *buf, *flag;
+	size_t n;
+	bool ok;
+
+	flag = _cbs_ccprep(pf->cmd, &run);
+	ok = _cbs_ccdkey(run, pf->src, &dkey);
+	free(flag);
+	strsfree(&run);
+	if (!ok)
+		return;
+	if (!_cbs_ccmanifest(dkey, &rkey)
+	 && !(_cbs_ccpull('m', dkey, true) && _cbs_ccmanifest(dkey, &rkey)))
+	{
+		return;
+	}
+	if (!_cbs_ccpull('a', rkey, false))
+		return;
+
+	path = _cbs_ccpath('a', rkey);
+	if (_cbs_readall(path, &buf, &n)) {
+		if (n >= 65 && _cbs_hunhex(buf, &objh) && _cbs_hunhex(buf + 33, &deph)) {
+			_cbs_ccpull('c', objh, false);
+			_cbs_ccpull('c', deph, false);
+		}
+		free(buf);
+	}
+	free(path);
+}
+
+static void
+_cbs_ccpffree(void *arg)
+{
+	struct _cbs_ccpf *pf = arg;
+	for (size_t i = 0; i < pf->cmd.len; i++)
+		free(pf->cmd.buf[i]);
+	strsfree(&pf->cmd);
+	free(pf->src);
+	free(pf);
+}
+
+void
+ccprefetch(tpool *tp, struct strs cmd, const char *src)
+{
+	struct _cbs_ccpf *pf;
+
+	if (_cbs_ccdir == NULL || _cbs_ccremote.host == NULL || _cbs_splitdwarf(cmd))
+		return;
+	assert((pf = calloc(1, sizeof(*pf))) != NULL);
+	for (size_t i = 0; i < cmd.len; i++) {
+		char *s = strdup(cmd.buf[i]);
+		assert(s != NULL);
+		strspushl(&pf->cmd, s);
+	}
+	assert((pf->src = strdup(src)) != NULL);
+	tpenq(tp, _cbs_ccpfjob, pf, _cbs_ccpffree);
+}
+#endif
+
+#ifndef CBS_NO_THREADS
+struct _cbs_fhashv {
+	char **fs;
+	struct hash128 *hs;
+	size_t n, next, jobs;
+	bool ok;
+	pthread_mutex_t mtx;
+	pthread_cond_t cnd;
+};
+
+static void
+_cbs_fhjob(void *arg)
+{
+	struct _cbs_fhashv *j = arg;
+
+	/* Each job keeps hashing files until there are none left, so that a
+	   single slow file doesn’t hold up the rest */
+	pthread_mutex_lock(&j->mtx);
+	while (j->next < j->n) {
+		size_t i = j->next++;
+		pthread_mutex_unlock(&j->mtx);
+
+		bool ok = fhash(j->fs[i], j->hs + i);
+		if (!ok)
+			memset(j->hs + i, 0, sizeof(*j->hs));
+
+		pthread_mutex_lock(&j->mtx);
+		if (!ok)
+			j->ok = false;
+	}
+	if (--j->jobs == 0)
+		pthread_cond_signal(&j->cnd);
+	pthread_mutex_unlock(&j->mtx);
+}
+
+bool
+fhashv(tpool *tp, char **fs, size_t n, struct hash128 *hs)
+{
+	struct _cbs_fhashv j = {
+		.fs = fs,
+		.hs = hs,
+		.n  = n,
+		.ok = true,
+	};
+
+	if (n == 0)
+		return true;
+
+	j.jobs = tp->tcnt < n ? tp->tcnt : n;
+	pthread_mutex_init(&j.mtx, NULL);
+	pthread_cond_init(&j.cnd, NULL);
+
+	for (size_t i = 0, m = j.jobs; i < m; i++)
+		tpenq(tp, _cbs_fhjob, &j, NULL);
+
+	pthread_mutex_lock(&j.mtx);
+	while (j.jobs > 0)
+		pthread_cond_wait(&j.cnd, &j.mtx);
+	pthread_mutex_unlock(&j.mtx);
+
+	pthread_cond_destroy(&j.cnd);
+	pthread_mutex_destroy(&j.mtx);
+	return j.ok;
+}
+#endif
+
+#ifndef CBS_NO_THREADS
+enum {
+	_CBS_TPASS,
+	_CBS_TFAIL,
+	_CBS_TTIMEOUT,
+	_CBS_TCACHED,
+};
+
+struct _cbs_test {
+	char *name;
+	struct strs cmd;
+	struct testopts o;
+};
+
+/* A single run of a test, or of one shard of a sharded test */
+struct _cbs_trun {
+	struct _cbs_test *t;
+	int shard, status, ec;
+	double secs;
+	char *out;
+	size_t outsz;
+};
+
+static struct _cbs_test *_cbs_tests;
+static size_t _cbs_ntests, _cbs_captests;
+_CBS_MUTEX(_cbs_testmtx);
+
+void
+testadd(const char *name, struct strs cmd, struct testopts o)
+{
+	struct _cbs_test t = {.o = o};
+
+	assert((t.name = strdup(name)) != NULL);
+	for (size_t i = 0; i < cmd.len; i++) {
+		char *s = strdup(cmd.buf[i]);
+		assert(s != NULL);
+		strspushl(&t.cmd, s);
+	}
+	for (int i = 0; i < 2; i++) {
+		char ***xs = i == 0 ? &t.o.ins : &t.o.env;
+		size_t n = i == 0 ? o.nins : o.nenv;
+		if (n == 0)
+			continue;
+		char **ys = malloc(n * sizeof(*ys));
+		assert(ys != NULL);
+		for (size_t j = 0; j < n; j++)
+			assert((ys[j] = strdup((*xs)[j])) != NULL);
+		*xs = ys;
+	}
+
+	_cbs_lock(_cbs_testmtx);
+	if (_cbs_ntests == _cbs_captests) {
+		_cbs_captests = _cbs_captests ? _cbs_captests * 2 : 64;
+		_cbs_tests = realloc(_cbs_tests, _cbs_captests * sizeof(*_cbs_tests));
+		assert(_cbs_tests != NULL);
+	}
+	_cbs_tests[_cbs_ntests++] = t;
+	_cbs_unlock(_cbs_testmtx);
+}
+
+/* Passing tests are cached by a key covering everything that may affect
+   their result, mapped to when they last passed.  A null value means the
+   test has failed since. */
+static struct _cbs_map _cbs_tcmap;
+static char *_cbs_tcpath;
+static bool  _cbs_tcdirty;
+_CBS_MUTEX(_cbs_tcmtx);
+
+static bool
+_cbs_testkey(struct _cbs_test *t, int shard, char hex[33])
+{
+	struct _cbs_hstate st;
+	struct hash128 h;
+	char *bin, buf[32];
+	bool ok;
+
+	if ((bin = _cbs_which(t->cmd.buf[0])) == NULL)
+		return false;
+	ok = fhash(bin, &h);
+	free(bin);
+	if (!ok)
+		return false;
+
+	_cbs_hinit(&st);
+	_cbs_hstr(&st, "cbs-test 1");
+	_cbs_hupdate(&st, &h, sizeof(h));
+	for (size_t i = 0; i < t->cmd.len; i++)
+		_cbs_hstr(&st, t->cmd.buf[i]);
+	snprintf(buf, sizeof(buf), "%d/%d", shard, t->o.shards);
+	_cbs_hstr(&st, buf);
+
+	for (size_t i = 0; i < t->o.nins; i++) {
+		if (!fhash(t->o.ins[i], &h))
+			return false;
+		_cbs_hstr(&st, t->o.ins[i]);
+		_cbs_hupdate(&st, &h, sizeof(h));
+	}
+
+	/* Distinguish unset variables from empty ones */
+	for (size_t i = 0; i < t->o.nenv; i++) {
+		const char *v = getenv(t->o.env[i]);
+		_cbs_hstr(&st, t->o.env[i]);
+		_cbs_hupdate(&st, v != NULL ? "=" : "!", 1);
+		if (v != NULL)
+			_cbs_hstr(&st, v);
+	}
+
+	_cbs_hhex(_cbs_hfinal(&st), hex);
+	return true;
+}
+
+static void
+_cbs_tcwrite(FILE *fp)
+{
+	time_t old = time(NULL) - 30 * 24 * 60 * 60;
+
+	/* Forget tests that haven’t passed in a month, as they were most
+	   likely changed or removed */
+	fputs("cbs-test 1\n", fp);
+	for (size_t i = 0; i < _cbs_tcmap.cap; i++) {
+		time_t t = (time_t)(intptr_t)_cbs_tcmap.buf[i].v;
+		if (_cbs_tcmap.buf[i].k != NULL && t > old)
+			fprintf(fp, "%s %lld\n", _cbs_tcmap.buf[i].k, (long long)t);
+	}
+}
+
+static void
+_cbs_tcsave(void)
+{
+	if (_cbs_tcdirty)
+		_cbs_fsave(_cbs_tcpath, _cbs_tcwrite);
+}
+
+void
+testcache(const char *path)
+{
+	FILE *fp;
+	char buf[128];
+
+	_cbs_lock(_cbs_tcmtx);
+	if (_cbs_tcpath == NULL)
+		atexit(_cbs_tcsave);
+	free(_cbs_tcpath);
+	assert((_cbs_tcpath = strdup(path)) != NULL);
+
+	if ((fp = _cbs_fload(path)) == NULL) {
+		_cbs_unlock(_cbs_tcmtx);
+		return;
+	}
+
+	if (fgets(buf, sizeof(buf), fp) != NULL && strcmp(buf, "cbs-test 1\n") == 0) {
+		char hex[33];
+		long long t;
+		while (fgets(buf, sizeof(buf), fp) != NULL) {
+			if (sscanf(buf, "%32s %lld", hex, &t) != 2)
+				break;
+			*_cbs_mapget(&_cbs_tcmap, hex, true) = (void *)(intptr_t)t;
+		}
+	}
+	fclose(fp);
+	_cbs_unlock(_cbs_tcmtx);
+}
+
+static double
+_cbs_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Wait for the process pid for at most timeout seconds, killing its
+   process group if it takes longer.  Returns the wait status. */
+static int
+_cbs_waitfor(pid_t pid, double timeout, bool *timedout)
+{
+	int ws;
+	double end = _cbs_now() + timeout;
+
+	*timedout = false;
+	if (timeout <= 0) {
+		while (waitpid(pid, &ws, 0) == -1)
+			assert(errno == EINTR);
+		return ws;
+	}
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	int fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd != -1) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		for (;;) {
+			double left = end - _cbs_now();
+			if (left <= 0)
+				break;
+			int n = poll(&pfd, 1, (int)(left * 1000) + 1);
+			if (n == 1 || (n == -1 && errno != EINTR))
+				break;
+		}
+		close(fd);
+	}
+#endif
+
+	/* Without pidfds, poll the process with an increasing interval */
+	for (long ns = 1000000;; ns = ns < 64000000 ? ns * 2 : ns) {
+		pid_t r = waitpid(pid, &ws, WNOHANG);
+		assert(r != -1 || errno == EINTR);
+		if (r == pid)
+			return ws;
+		double left = end - _cbs_now();
+		if (left <= 0)
+			break;
+		if (left * 1e9 < ns)
+			ns = (long)(left * 1e9) + 1;
+		nanosleep(&(struct timespec){.tv_nsec = ns}, NULL);
+	}
+
+	*timedout = true;
+	kill(-pid, SIGKILL);
+	while (waitpid(pid, &ws, 0) == -1)
+		assert(errno == EINTR);
+	return ws;
+}
+
+static void
+_cbs_testjob(void *arg)
+{
+	extern char **environ;
+	struct _cbs_trun *r = arg;
+	struct _cbs_test *t = r->t;
+	char tmpl[PATH_MAX], total[32], index[32], **env;
+	const char *tmpdir;
+	int out, null, ws;
+	size_t n = 0;
+	bool timedout;
+
+	if (cbsopts.dryrun)
+		return;
+
+	char key[33];
+	bool cache = false;
+	if (_cbs_tcpath != NULL && _cbs_testkey(t, r->shard, key)) {
+		cache = true;
+		_cbs_lock(_cbs_tcmtx);
+		void **v = _cbs_mapget(&_cbs_tcmap, key, false);
+		bool hit = v != NULL && *v != NULL;
+		_cbs_unlock(_cbs_tcmtx);
+		if (hit) {
+			r->status = _CBS_TCACHED;
+			flockfile(stdout);
+			printf("CACHED %s", t->name);
+			if (t->o.shards > 1)
+				printf(" [%d/%d]", r->shard, t->o.shards);
+			putchar('\n');
+			funlockfile(stdout);
+			return;
+		}
+	}
+
+	/* Tell gtest-style test binaries which of their cases to run */
+	for (char **e = environ; *e != NULL; e++)
+		n++;
+	assert((env = malloc((n + 3) * sizeof(*env))) != NULL);
+	n = 0;
+	for (char **e = environ; *e != NULL; e++) {
+		if (strncmp(*e, "GTEST_TOTAL_SHARDS=", 19) != 0
+		 && strncmp(*e, "GTEST_SHARD_INDEX=", 18) != 0)
+		{
+			env[n++] = *e;
+		}
+	}
+	if (t->o.shards > 1) {
+		snprintf(total, sizeof(total), "GTEST_TOTAL_SHARDS=%d", t->o.shards);
+		snprintf(index, sizeof(index), "GTEST_SHARD_INDEX=%d", r->shard);
+		env[n++] = total;
+		env[n++] = index;
+	}
+	env[n] = NULL;
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == 0)
+		tmpdir = "/tmp";
+	snprintf(tmpl, sizeof(tmpl), "%s/cbs-test.XXXXXX", tmpdir);
+	assert((out = mkostemp(tmpl, O_CLOEXEC)) != -1);
+	unlink(tmpl);
+	assert((null = open("/dev/null", O_RDONLY | O_CLOEXEC)) != -1);
+
+	double start = _cbs_now();
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		/* Give the test its own process group, so that a timeout also
+		   kills whatever it spawned */
+		setpgid(0, 0);
+		if (dup2(null, STDIN_FILENO) == -1 || dup2(out, STDOUT_FILENO) == -1
+		 || dup2(out, STDERR_FILENO) == -1)
+		{
+			_exit(127);
+		}
+		_cbs_child();
+		environ = env;
+		execvp(t->cmd.buf[0], t->cmd.buf);
+		dprintf(STDERR_FILENO, "%s: %s\n", t->cmd.buf[0], strerror(errno));
+		_exit(127);
+	}
+	setpgid(pid, pid);
+	close(null);
+	free(env);
+
+	ws = _cbs_waitfor(pid, t->o.timeout, &timedout);
+	r->secs = _cbs_now() - start;
+	r->ec = WIFEXITED(ws) ? WEXITSTATUS(ws) : 128 + WTERMSIG(ws);
+	r->status = timedout ? _CBS_TTIMEOUT
+	          : r->ec == EXIT_SUCCESS ? _CBS_TPASS : _CBS_TFAIL;
+
+	/* Only passes are cached, so failing tests always run again */
+	if (cache) {
+		_cbs_lock(_cbs_tcmtx);
+		void **v = _cbs_mapget(&_cbs_tcmap, key, r->status == _CBS_TPASS);
+		if (v != NULL) {
+			*v = r->status == _CBS_TPASS ? (void *)(intptr_t)time(NULL) : NULL;
+			_cbs_tcdirty = true;
+		}
+		_cbs_unlock(_cbs_tcmtx);
+	}
+
+	/* Output is only kept for failures, to keep the report small */
+	if (r->status != _CBS_TPASS) {
+		struct stat sb;
+		assert(fstat(out, &sb) != -1);
+		assert((r->out = malloc(sb.st_size + 1)) != NULL);
+		ssize_t nr = pread(out, r->out, sb.st_size, 0);
+		r->outsz = nr > 0 ? (size_t)nr : 0;
+		r->out[r->outsz] = 0;
+	}
+	close(out);
+
+	flockfile(stdout);
+	flockfile(stderr);
+	printf("%s %s", r->status == _CBS_TPASS    ? "PASS"
+	              : r->status == _CBS_TTIMEOUT ? "TIMEOUT"
+	                                           : "FAIL",
+	       t->name);
+	if (t->o.shards > 1)
+		printf(" [%d/%d]", r->shard, t->o.shards);
+	printf(" (%.2fs)\n", r->secs);
+	if (r->status != _CBS_TPASS) {
+		fflush(stdout);
+		fwrite(r->out, 1, r->outsz, stderr);
+		fflush(stderr);
+	}
+	funlockfile(stderr);
+	funlockfile(stdout);
+}
+
+static void
+_cbs_jsonstr(FILE *fp, const char *s, size_t n)
+{
+	fputc('"', fp);
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", fp);
+		else if (c == '\t')
+			fputs("\\t", fp);
+		else if (c < 0x20 || c == 0x7F)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+static void
+_cbs_xmlstr(FILE *fp, const char *s, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = s[i];
+		switch (c) {
+		case '&':  fputs("&amp;", fp);  break;
+		case '<':  fputs("&lt;", fp);   break;
+		case '>':  fputs("&gt;", fp);   break;
+		case '"':  fputs("&quot;", fp); break;
+		default:
+			/* Most control characters may not appear in XML at all */
+			if (c >= 0x20 || c == '\t' || c == '\n' || c == '\r')
+				fputc(c, fp);
+		}
+	}
+}
+
+static const char *
+_cbs_tstatus(int status)
+{
+	return status == _CBS_TPASS    ? "pass"
+	     : status == _CBS_TCACHED  ? "cached"
+	     : status == _CBS_TTIMEOUT ? "timeout"
+	                               : "fail";
+}
+
+static bool
+_cbs_tfailed(int status)
+{
+	return status != _CBS_TPASS && status != _CBS_TCACHED;
+}
+
+static void
+_cbs_testreport(const char *path, struct _cbs_trun *rs, size_t n)
+{
+	char *rep;
+	size_t repsz, len = strlen(path), failed = 0;
+	double secs = 0;
+	bool xml = len >= 4 && strcmp(path + len - 4, ".xml") == 0;
+	FILE *fp = open_memstream(&rep, &repsz);
+
+	assert(fp != NULL);
+	for (size_t i = 0; i < n; i++) {
+		failed += _cbs_tfailed(rs[i].status);
+		secs += rs[i].secs;
+	}
+
+	if (xml) {
+		fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		            "<testsuites tests=\"%zu\" failures=\"%zu\" time=\"%.3f\">\n"
+		            "<testsuite name=\"cbs\" tests=\"%zu\" failures=\"%zu\" "
+		            "time=\"%.3f\">\n",
+		        n, failed, secs, n, failed, secs);
+	} else
+		fputs("{\n  \"tests\": [", fp);
+
+	for (size_t i = 0; i < n; i++) {
+		struct _cbs_trun *r = rs + i;
+		char *name = r->t->name, buf[PATH_MAX];
+		if (r->t->o.shards > 1) {
+			snprintf(buf, sizeof(buf), "%s/%d", r->t->name, r->shard);
+			name = buf;
+		}
+
+		if (xml) {
+			fputs("<testcase name=\"", fp);
+			_cbs_xmlstr(fp, name, strlen(name));
+			fprintf(fp, "\" time=\"%.3f\"", r->secs);
+			if (!_cbs_tfailed(r->status)) {
+				fputs("/>\n", fp);
+				continue;
+			}
+			fprintf(fp, ">\n<failure message=\"%s\">",
+			        r->status == _CBS_TTIMEOUT ? "timed out" : "failed");
+			_cbs_xmlstr(fp, r->out, r->outsz);
+			fputs("</failure>\n</testcase>\n", fp);
+		} else {
+			fprintf(fp, "%s\n    {\"name\": ", i > 0 ? "," : "");
+			_cbs_jsonstr(fp, name, strlen(name));
+			fprintf(fp, ", \"status\": \"%s\", \"exit\": %d, \"time\": %.3f",
+			        _cbs_tstatus(r->status), r->ec, r->secs);
+			if (_cbs_tfailed(r->status)) {
+				fputs(", \"output\": ", fp);
+				_cbs_jsonstr(fp, r->out, r->outsz);
+			}
+			fputc('}', fp);
+		}
+	}
+
+	if (xml)
+		fputs("</testsuite>\n</testsuites>\n", fp);
+	else {
+		fprintf(fp, "\n  ],\n  \"passed\": %zu,\n  \"failed\": %zu,\n"
+		            "  \"time\": %.3f\n}\n",
+		        n - failed, failed, secs);
+	}
+
+	assert(fclose(fp) != EOF);
+	if (!_cbs_writeall(path, rep, repsz))
+		fprintf(stderr, "%s: write: %s: %s\n", *_cbs_argv, path, strerror(errno));
+	free(rep);
+}
+
+bool
+testrun(tpool *tp, const char *report)
+{
+	struct _cbs_trun *rs;
+	size_t n = 0, failed = 0, cached = 0;
+	tgroup tg = {0};
+
+	_cbs_lock(_cbs_testmtx);
+	for (size_t i = 0; i < _cbs_ntests; i++)
+		n += _cbs_tests[i].o.shards > 1 ? (size_t)_cbs_tests[i].o.shards : 1;
+	assert((rs = calloc(n ? n : 1, sizeof(*rs))) != NULL);
+
+	for (size_t i = 0, j = 0; i < _cbs_ntests; i++) {
+		struct _cbs_test *t = _cbs_tests + i;
+		int shards = t->o.shards > 1 ? t->o.shards : 1;
+		for (int k = 0; k < shards; k++, j++) {
+			rs[j].t = t;
+			rs[j].shard = k;
+			tpenqx(tp, _cbs_testjob, rs + j, NULL,
+			       (struct tjobopts){.in = &tg, .res = t->o.res});
+		}
+	}
+	_cbs_unlock(_cbs_testmtx);
+
+	tgwait(tp, &tg);
+
+	for (size_t i = 0; i < n; i++) {
+		failed += _cbs_tfailed(rs[i].status);
+		cached += rs[i].status == _CBS_TCACHED;
+	}
+	if (!cbsopts.dryrun && cached > 0)
+		printf("%zu/%zu tests passed (%zu cached)\n", n - failed, n, cached);
+	else if (!cbsopts.dryrun)
+		printf("%zu/%zu tests passed\n", n - failed, n);
+	if (report != NULL && !cbsopts.dryrun)
+		_cbs_testreport(report, rs, n);
+
+	for (size_t i = 0; i < n; i++)
+		free(rs[i].out);
+	free(rs);
+	return failed == 0;
+}
+#endif
+
 #ifdef __GNUC__
 #	pragma GCC diagnostic pop
 #endif
@@ -0,0 +1,35 @@
+/* Check that paths under the compilation cache base directory survive
+   being normalized and mapped back.  Run with:
+
+       cc -std=c99 -pthread -o ccnorm tests/ccnorm.c && ./ccnorm */
+
+#include "../cbs.h"
+
+static void
+roundtrip(const char *s, bool changed)
+{
+	char *n = _cbs_ccnorm(s), *u = _cbs_ccunnorm(n);
+	assert((strchr(n, _CBS_CCBASE[0]) != NULL) == changed);
+	assert(strcmp(u, s) == 0);
+	free(n);
+	free(u);
+}
+
+int
+main(int argc, char **argv)
+{
+	cbsinit(argc, argv);
+
+	ccbase("/tmp");
+	roundtrip("/tmp/inc/x.h", true);
+	roundtrip("-I/tmp/inc", true);
+	roundtrip("x.o: /tmp/x.c /tmp/inc/x.h \\\n /usr/include/stdio.h\n", true);
+	roundtrip("/tmpx/inc/x.h", false);
+	roundtrip("/usr/include/stdio.h", false);
+
+	ccbase("/");
+	roundtrip("/tmp/inc/x.h", false);
+
+	puts("ok");
+	return EXIT_SUCCESS;
+}